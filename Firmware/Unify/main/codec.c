@@ -0,0 +1,388 @@
+/********************************************************************************
+ * File Name          : codec.c
+ * Author             : Jack Shaver
+ * Date               : 10/17/2026
+ * Description        : Block Codec Source
+ ********************************************************************************/
+
+#include "codec.h"
+#include "logging.h"
+#include "sd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h> // offsetof
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+
+#include "esp_console.h"
+#include "argtable3/argtable3.h" // command creation
+
+#define CODEC_GROUP 16 // frames sharing one bit width per column
+#define CODEC_WIDTH_BITS 5
+#define CODEC_MAX_WIDTH 18 // a full swing of the 16 bit time offset, differenced twice and zigzagged
+#define MAX_COLUMNS (LOG_MAX_CHANNELS + 2) // time offset, lateness, then the samples
+
+static const char *TAG = "codec";
+
+// Every field of a record is a column: the time offset, the lateness and each 12 bit sample
+// A column is stored as the difference from the frame before it, zigzagged so small steps either way are small numbers,
+// then packed at the width of the largest one in each group of CODEC_GROUP frames, the width goes first in 5 bits
+// The time offset climbs by the sample period every frame, so it is differenced twice and only the jitter is left
+// Slow sensors and the steady sample period end up as a few bits per value, a step only costs its own group
+
+typedef struct {
+	uint8_t *data;
+	size_t used;
+	size_t limit;
+	uint32_t bits;
+	int count;
+	bool full;
+} bit_writer_t;
+
+typedef struct {
+	const uint8_t *data;
+	size_t used;
+	size_t limit;
+	uint32_t bits;
+	int count;
+	bool empty;
+} bit_reader_t;
+
+static void putBits(bit_writer_t *writer, uint32_t value, int width){
+	if(writer->full){
+		return;
+	}
+	writer->bits |= value << writer->count;
+	writer->count += width;
+	while(writer->count >= 8){
+		if(writer->used == writer->limit){
+			writer->full = true;
+			return;
+		}
+		writer->data[writer->used++] = writer->bits;
+		writer->bits >>= 8;
+		writer->count -= 8;
+	}
+}
+
+static uint32_t getBits(bit_reader_t *reader, int width){
+	while(reader->count < width){
+		uint32_t next = 0;
+		if(reader->used < reader->limit){
+			next = reader->data[reader->used++];
+		}else{
+			reader->empty = true;
+		}
+		reader->bits |= next << reader->count;
+		reader->count += 8;
+	}
+	uint32_t value = reader->bits & ((1UL << width) - 1);
+	reader->bits >>= width;
+	reader->count -= width;
+	return value;
+}
+
+static uint32_t zigzag(int32_t value){
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value){
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static int bitWidth(uint32_t value){
+	return (value == 0) ? 0 : 32 - __builtin_clz(value);
+}
+
+static void readFrame(const uint8_t *record, int channels, int32_t *columns){
+	uint16_t offsetUs;
+	uint8_t late;
+	uint16_t codes[LOG_MAX_CHANNELS];
+	logRecordUnpack(record, channels, &offsetUs, &late, codes);
+	columns[0] = offsetUs;
+	columns[1] = late;
+	for(int n = 0; n < channels; n++){
+		columns[2 + n] = codes[n];
+	}
+}
+
+static void writeFrame(uint8_t *record, int channels, const int32_t *columns){
+	uint16_t codes[LOG_MAX_CHANNELS];
+	for(int n = 0; n < channels; n++){
+		codes[n] = columns[2 + n];
+	}
+	logRecordPack(record, columns[0], columns[1], codes, channels);
+}
+
+static int blockFrames(const codec_layout_t *layout, const uint8_t *block){
+	uint16_t frames;
+	memcpy(&frames, &block[8], sizeof(frames));
+	return (frames > layout->framesPerBlock) ? layout->framesPerBlock : frames;
+}
+
+size_t codecCaptureBytes(const codec_layout_t *layout){
+	return LOG_BLOCK_HEADER_BYTES + layout->framesPerBlock * layout->recordBytes;
+}
+
+size_t codecEncodeBlock(const codec_layout_t *layout, const uint8_t *capture, uint8_t *out){
+	size_t captureBytes = codecCaptureBytes(layout);
+	int columns = layout->channels + 2;
+	int frames = blockFrames(layout, capture);
+
+	memcpy(out, capture, LOG_BLOCK_HEADER_BYTES);
+	bit_writer_t writer = {
+		.data = out,
+		.used = LOG_BLOCK_HEADER_BYTES,
+		.limit = captureBytes - 1 // has to come out smaller than the block
+	};
+
+	int32_t previous[MAX_COLUMNS] = {0};
+	int32_t period = 0; // last step of the time offset
+	uint32_t deltas[CODEC_GROUP][MAX_COLUMNS];
+	for(int first = 0; first < frames && writer.full == false; first += CODEC_GROUP){
+		int count = (frames - first < CODEC_GROUP) ? frames - first : CODEC_GROUP;
+		uint32_t widest[MAX_COLUMNS] = {0};
+		for(int f = 0; f < count; f++){
+			int32_t values[MAX_COLUMNS];
+			readFrame(&capture[LOG_BLOCK_HEADER_BYTES + (first + f) * layout->recordBytes], layout->channels, values);
+			int32_t step = values[0] - previous[0];
+			deltas[f][0] = zigzag(step - period);
+			period = step;
+			previous[0] = values[0];
+			widest[0] |= deltas[f][0];
+			for(int c = 1; c < columns; c++){
+				deltas[f][c] = zigzag(values[c] - previous[c]);
+				previous[c] = values[c];
+				widest[c] |= deltas[f][c];
+			}
+		}
+		for(int c = 0; c < columns; c++){
+			int width = bitWidth(widest[c]);
+			putBits(&writer, width, CODEC_WIDTH_BITS);
+			for(int f = 0; f < count; f++){
+				putBits(&writer, deltas[f][c], width);
+			}
+		}
+	}
+	if(writer.count != 0){
+		putBits(&writer, 0, 8 - writer.count); // last partial byte
+	}
+
+	if(writer.full){
+		memcpy(out, capture, captureBytes);
+		return captureBytes;
+	}
+	return writer.used;
+}
+
+esp_err_t codecDecodeBlock(const codec_layout_t *layout, const uint8_t *packed, size_t bytes, uint8_t *capture){
+	size_t captureBytes = codecCaptureBytes(layout);
+	if(bytes == captureBytes){
+		memcpy(capture, packed, captureBytes);
+		return ESP_OK;
+	}
+	if(bytes < LOG_BLOCK_HEADER_BYTES || bytes > captureBytes || layout->channels > LOG_MAX_CHANNELS){
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	memset(capture, 0, captureBytes); // records past the frame count are left empty
+	memcpy(capture, packed, LOG_BLOCK_HEADER_BYTES);
+	int columns = layout->channels + 2;
+	int frames = blockFrames(layout, capture);
+	bit_reader_t reader = {
+		.data = packed,
+		.used = LOG_BLOCK_HEADER_BYTES,
+		.limit = bytes
+	};
+
+	int32_t previous[MAX_COLUMNS] = {0};
+	int32_t period = 0;
+	int32_t values[CODEC_GROUP][MAX_COLUMNS];
+	for(int first = 0; first < frames; first += CODEC_GROUP){
+		int count = (frames - first < CODEC_GROUP) ? frames - first : CODEC_GROUP;
+		for(int c = 0; c < columns; c++){
+			int width = getBits(&reader, CODEC_WIDTH_BITS);
+			if(width > CODEC_MAX_WIDTH){
+				return ESP_ERR_INVALID_RESPONSE;
+			}
+			for(int f = 0; f < count; f++){
+				int32_t delta = unzigzag(getBits(&reader, width));
+				if(c == 0){
+					period += delta;
+					delta = period;
+				}
+				previous[c] += delta;
+				values[f][c] = previous[c];
+			}
+		}
+		for(int f = 0; f < count; f++){
+			writeFrame(&capture[LOG_BLOCK_HEADER_BYTES + (first + f) * layout->recordBytes], layout->channels, values[f]);
+		}
+	}
+	return reader.empty ? ESP_ERR_INVALID_SIZE : ESP_OK;
+}
+
+// ================================= Benchmark ==============================================
+// Packs every block of a recorded log, unpacks it again and checks it matches, only the codec calls are timed
+
+typedef struct {
+	long blocks;
+	long stored; // did not shrink, kept unpacked
+	long mismatches;
+	long damaged; // packed blocks in the file that would not unpack, left out of the rest
+	long long rawBytes; // capture blocks as the writer hands them over
+	long long packedBytes;
+	int64_t encodeUs;
+	int64_t decodeUs;
+} codec_result_t;
+
+static void benchBlock(const codec_layout_t *layout, const uint8_t *capture, uint8_t *packed, uint8_t *check, codec_result_t *result){
+	size_t captureBytes = codecCaptureBytes(layout);
+	size_t usedBytes = LOG_BLOCK_HEADER_BYTES + blockFrames(layout, capture) * layout->recordBytes;
+
+	int64_t startUs = esp_timer_get_time();
+	size_t bytes = codecEncodeBlock(layout, capture, packed);
+	int64_t encodedUs = esp_timer_get_time();
+	esp_err_t err = codecDecodeBlock(layout, packed, bytes, check);
+	result->decodeUs += esp_timer_get_time() - encodedUs;
+	result->encodeUs += encodedUs - startUs;
+
+	result->blocks++;
+	result->rawBytes += captureBytes;
+	result->packedBytes += bytes;
+	if(bytes == captureBytes){
+		result->stored++;
+	}
+	if(err != ESP_OK || memcmp(capture, check, usedBytes) != 0){
+		result->mismatches++;
+	}
+}
+
+static esp_err_t benchFile(FILE *in, codec_result_t *result){
+	memset(result, 0, sizeof(codec_result_t));
+	log_file_header_t header;
+	if(logReadExact(in, &header, sizeof(header)) == false || header.magic != LOG_FILE_MAGIC
+		|| esp_rom_crc32_le(0, (uint8_t *)&header, offsetof(log_file_header_t, crc)) != header.crc){
+		ESP_LOGE(TAG, "Not a log file");
+		return ESP_ERR_INVALID_ARG;
+	}
+	if(header.version > LOG_FORMAT_VERSION){
+		ESP_LOGE(TAG, "Log format %u is newer than this firmware", header.version);
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	codec_layout_t layout = {
+		.channels = header.channelCount,
+		.recordBytes = header.recordBytes,
+		.framesPerBlock = header.framesPerBlock
+	};
+	size_t captureBytes = codecCaptureBytes(&layout);
+	if(header.channelCount > LOG_MAX_CHANNELS || captureBytes != header.blockBytes - sizeof(log_block_prefix_t) - sizeof(uint32_t)){
+		ESP_LOGE(TAG, "Unsupported log layout");
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	fseek(in, header.headerBytes, SEEK_SET);
+
+	uint8_t *buffers = malloc(3 * captureBytes);
+	if(buffers == NULL){
+		return ESP_ERR_NO_MEM;
+	}
+	uint8_t *capture = buffers;
+	uint8_t *packed = &buffers[captureBytes];
+	uint8_t *check = &buffers[2 * captureBytes];
+
+	// Packed logs are unpacked first, so either kind can be measured
+	uint32_t magic;
+	while(logReadExact(in, &magic, sizeof(magic))){
+		uint32_t sequence;
+		uint32_t crc;
+		if(magic == LOG_BLOCK_MAGIC){
+			if(logReadExact(in, &sequence, sizeof(sequence)) == false || logReadExact(in, capture, captureBytes) == false || logReadExact(in, &crc, sizeof(crc)) == false){
+				break;
+			}
+		}else if(magic == LOG_PACKED_MAGIC){
+			uint32_t bytes;
+			if(logReadExact(in, &sequence, sizeof(sequence)) == false || logReadExact(in, &bytes, sizeof(bytes)) == false || bytes > captureBytes
+				|| logReadExact(in, packed, bytes) == false || logReadExact(in, &crc, sizeof(crc)) == false){
+				break;
+			}
+			if(codecDecodeBlock(&layout, packed, bytes, capture) != ESP_OK){
+				result->damaged++;
+				continue;
+			}
+		}else{
+			break; // the peak table or the end of the run
+		}
+		benchBlock(&layout, capture, packed, check, result);
+	}
+	free(buffers);
+	return ESP_OK;
+}
+
+// Stuff for the console
+static struct {
+	struct arg_int *index; // log<index>.bin
+    struct arg_end *end;
+} codec_args;
+
+static int codecCommand(int argc, char **argv){
+	int nerrors = arg_parse(argc, argv, (void  **) &codec_args);
+	if (nerrors != 0) {
+        arg_print_errors(stderr, codec_args.end, argv[0]);
+        return 1;
+    }
+	if(loggingIsArmed()){
+		ESP_LOGE(TAG, "A run is armed, measure once it is written");
+		return 1;
+	}
+
+	char path[50];
+	sprintf(path, "%s/log%d.bin", SD_MOUNT_POINT, codec_args.index->ival[0]);
+	FILE *in = fopen(path, "r");
+	if(in == NULL){
+		ESP_LOGE(TAG, "No log %d", codec_args.index->ival[0]);
+		return 1;
+	}
+	codec_result_t result;
+	esp_err_t err = benchFile(in, &result);
+	fclose(in);
+	if(err != ESP_OK){
+		return 1;
+	}
+	if(result.damaged != 0){
+		ESP_LOGE(TAG, "%ld packed blocks in the log would not unpack", result.damaged);
+	}
+	if(result.blocks == 0 || result.packedBytes == 0){
+		ESP_LOGW(TAG, "No blocks in log %d", codec_args.index->ival[0]);
+		return 1;
+	}
+
+	double megabytes = result.rawBytes / (1024.0 * 1024.0);
+	printf("%ld blocks, %lld KB packed to %lld KB, %.2fx, %ld stored unpacked\n",
+		result.blocks, result.rawBytes / 1024, result.packedBytes / 1024, (double)result.rawBytes / result.packedBytes, result.stored);
+	printf("encode %.2f MB/s, decode %.2f MB/s\n",
+		megabytes / (result.encodeUs / 1000000.0), megabytes / (result.decodeUs / 1000000.0));
+	if(result.mismatches != 0){
+		ESP_LOGE(TAG, "%ld blocks did not come back the same", result.mismatches);
+		return 1;
+	}
+	return (result.damaged == 0) ? 0 : 1;
+}
+
+void codecRegisterCommands(){
+	codec_args.index = arg_int1(NULL, NULL, "<index>", "Log number, log<index>.bin on the card");
+	codec_args.end = arg_end(2);
+
+	const esp_console_cmd_t cmd_codec = {
+		.command = "log-codec",
+		.help = "Pack and unpack every block of a log, prints the ratio and MB/s.",
+		.hint = NULL,
+		.func = &codecCommand,
+		.argtable = &codec_args
+	};
+
+	ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_codec));
+}
@@ -0,0 +1,39 @@
+/********************************************************************************
+ * File Name          : codec.h
+ * Author             : Jack Shaver
+ * Date               : 10/17/2026
+ * Description        : Block Codec Header
+ ********************************************************************************/
+
+#ifndef codec_h
+#define codec_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// Shape of a capture block, the same numbers as the log file header
+typedef struct {
+	int channels;
+	size_t recordBytes;
+	int framesPerBlock;
+} codec_layout_t;
+
+extern size_t codecCaptureBytes(const codec_layout_t *layout); // size of an unpacked capture block
+
+// Lossless, out has to hold codecCaptureBytes, a block that does not shrink is copied as is
+// Returns the packed size, codecCaptureBytes means the block was stored unpacked
+extern size_t codecEncodeBlock(const codec_layout_t *layout, const uint8_t *capture, uint8_t *out);
+extern esp_err_t codecDecodeBlock(const codec_layout_t *layout, const uint8_t *packed, size_t bytes, uint8_t *capture);
+
+extern void codecRegisterCommands();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
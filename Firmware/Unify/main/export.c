@@ -0,0 +1,435 @@
+/********************************************************************************
+ * File Name          : export.c
+ * Author             : Jack Shaver
+ * Date               : 10/17/2026
+ * Description        : Log Export Source
+ ********************************************************************************/
+
+#include "export.h"
+#include "logging.h"
+#include "sd.h"
+#include "codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h> // offsetof
+#include <unistd.h> // unlink
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+
+#include "esp_console.h"
+#include "argtable3/argtable3.h" // command creation
+
+#define MAX_BLOCK_BYTES (64 * 1024) // anything bigger is a damaged header
+#define CSV_ROW_BYTES 192 // longest row, a 20 digit time and 16 columns of up to 7 characters
+
+static const char *TAG = "export";
+
+// The csv goes out one of two ways so the benchmark can compare them
+// Fast: rows are formatted by hand into a cluster sized buffer and written a whole cluster at a time
+// Stdio: an fprintf per value, how the logs used to be written
+static FILE *csvFile = NULL;
+static bool csvFast = true;
+static char *csvBuffer = NULL; // one cluster plus room for the row that crosses into the next
+static size_t csvUsed = 0;
+
+// Writes the digits of value, returns the characters written
+static int formatInt(char *out, int64_t value){
+	char digits[20];
+	int n = 0;
+	int length = 0;
+	uint64_t magnitude = value;
+	if(value < 0){
+		out[length++] = '-';
+		magnitude = -magnitude;
+	}
+	do{
+		digits[n++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	}while(magnitude != 0);
+	while(n != 0){
+		out[length++] = digits[--n];
+	}
+	return length;
+}
+
+// Whole clusters go out, the rest moves to the front of the buffer
+static void csvFlush(bool all){
+	while(csvUsed >= SD_CLUSTER_BYTES){
+		fwrite(csvBuffer, 1, SD_CLUSTER_BYTES, csvFile);
+		csvUsed -= SD_CLUSTER_BYTES;
+		memmove(csvBuffer, &csvBuffer[SD_CLUSTER_BYTES], csvUsed);
+	}
+	if(all && csvUsed != 0){
+		fwrite(csvBuffer, 1, csvUsed, csvFile);
+		csvUsed = 0;
+	}
+}
+
+static void csvText(const char *text){
+	if(csvFast == false){
+		fputs(text, csvFile);
+		return;
+	}
+	size_t length = strlen(text);
+	while(length != 0){
+		size_t chunk = SD_CLUSTER_BYTES + CSV_ROW_BYTES - csvUsed;
+		if(chunk > length){
+			chunk = length;
+		}
+		memcpy(&csvBuffer[csvUsed], text, chunk);
+		csvUsed += chunk;
+		text += chunk;
+		length -= chunk;
+		csvFlush(false);
+	}
+}
+
+// first, values[0], ... values[count - 1]
+static void csvRow(int64_t first, uint16_t *values, int count){
+	if(csvFast == false){
+		fprintf(csvFile, "%lld", first);
+		for(int i = 0; i < count; i++){
+			fprintf(csvFile, ", %d", values[i]);
+		}
+		fprintf(csvFile, "\n");
+		return;
+	}
+	char *out = &csvBuffer[csvUsed];
+	char *start = out;
+	out += formatInt(out, first);
+	for(int i = 0; i < count; i++){
+		*out++ = ',';
+		*out++ = ' ';
+		out += formatInt(out, values[i]);
+	}
+	*out++ = '\n';
+	csvUsed += out - start;
+	if(csvUsed >= SD_CLUSTER_BYTES){
+		csvFlush(false);
+	}
+}
+
+static void csvHeader(const char *first, uint8_t mask, const char *suffix){
+	csvText(first);
+	for(int i = 0; i < LOG_MAX_CHANNELS; i++){
+		if(mask & (1 << i)){
+			csvText(", ");
+			csvText(loggingChannelName(i));
+			csvText(suffix);
+		}
+	}
+}
+
+// Frames of one capture block, samples are written left justified like the adc codes
+static long exportBlock(log_file_header_t *header, uint8_t *capture){
+	int64_t baseUs;
+	uint16_t frames;
+	memcpy(&baseUs, capture, sizeof(baseUs));
+	memcpy(&frames, &capture[8], sizeof(frames));
+	if(frames > header->framesPerBlock){
+		frames = header->framesPerBlock;
+	}
+	
+	uint16_t values[LOG_MAX_CHANNELS + 1]; // samples then lateness
+	uint8_t *record = &capture[LOG_BLOCK_HEADER_BYTES];
+	for(int f = 0; f < frames; f++){
+		uint16_t offsetUs;
+		uint8_t late;
+		logRecordUnpack(record, header->channelCount, &offsetUs, &late, values);
+		for(int n = 0; n < header->channelCount; n++){
+			values[n] <<= 4;
+		}
+		values[header->channelCount] = late;
+		csvRow(baseUs + offsetUs, values, header->channelCount + 1);
+		record += header->recordBytes;
+	}
+	return frames;
+}
+
+// The peak table follows the samples after a blank line, like the old csv logs
+static void exportPeaks(FILE *in, log_file_header_t *header){
+	log_peak_prefix_t prefix = {.magic = LOG_PEAK_MAGIC};
+	if(logReadExact(in, &prefix.windows, sizeof(prefix) - sizeof(prefix.magic)) == false || prefix.channels != header->channelCount){
+		ESP_LOGW(TAG, "Damaged peak table");
+		return;
+	}
+	size_t timeBytes = prefix.windows * sizeof(int64_t);
+	size_t valueBytes = prefix.windows * prefix.channels * sizeof(uint16_t);
+	uint8_t *table = malloc(timeBytes + 2 * valueBytes);
+	uint32_t crc;
+	if(table == NULL || logReadExact(in, table, timeBytes + 2 * valueBytes) == false || logReadExact(in, &crc, sizeof(crc)) == false){
+		ESP_LOGW(TAG, "Damaged peak table");
+		free(table);
+		return;
+	}
+	uint32_t check = esp_rom_crc32_le(0, (uint8_t *)&prefix, sizeof(prefix));
+	check = esp_rom_crc32_le(check, table, timeBytes + 2 * valueBytes);
+	if(check != crc){
+		ESP_LOGW(TAG, "Peak table crc mismatch, skipped");
+		free(table);
+		return;
+	}
+	
+	int64_t *timeStamp = (int64_t *)table;
+	uint16_t *maximum = (uint16_t *)&table[timeBytes];
+	uint16_t *minimum = (uint16_t *)&table[timeBytes + valueBytes];
+	csvText("\n");
+	csvHeader("peakTimeUs", header->channelMask, "Max");
+	csvHeader("", header->channelMask, "Min");
+	csvText("\n");
+	
+	uint16_t values[2 * LOG_MAX_CHANNELS];
+	for(long w = 0; w < prefix.windows; w++){
+		memcpy(values, &maximum[w * prefix.channels], prefix.channels * sizeof(uint16_t));
+		memcpy(&values[prefix.channels], &minimum[w * prefix.channels], prefix.channels * sizeof(uint16_t));
+		csvRow(timeStamp[w], values, 2 * prefix.channels);
+	}
+	free(table);
+}
+
+// Packed blocks are variable length, the codec turns them back into the capture block
+static esp_err_t readPacked(FILE *in, log_file_header_t *header, uint8_t *packed, uint8_t *capture, uint32_t *sequence){
+	log_packed_prefix_t prefix = {.magic = LOG_PACKED_MAGIC};
+	uint32_t crc;
+	codec_layout_t layout = {
+		.channels = header->channelCount,
+		.recordBytes = header->recordBytes,
+		.framesPerBlock = header->framesPerBlock
+	};
+	if(logReadExact(in, &prefix.sequence, sizeof(prefix) - sizeof(prefix.magic)) == false || prefix.bytes > codecCaptureBytes(&layout)
+		|| logReadExact(in, packed, prefix.bytes) == false || logReadExact(in, &crc, sizeof(crc)) == false){
+		return ESP_ERR_INVALID_SIZE;
+	}
+	uint32_t check = esp_rom_crc32_le(0, (uint8_t *)&prefix, sizeof(prefix));
+	check = esp_rom_crc32_le(check, packed, prefix.bytes);
+	if(check != crc || codecDecodeBlock(&layout, packed, prefix.bytes, capture) != ESP_OK){
+		return ESP_ERR_INVALID_CRC;
+	}
+	*sequence = prefix.sequence;
+	return ESP_OK;
+}
+
+// Totals of one export, the benchmark compares these between the two paths
+typedef struct{
+	long rows;
+	long badBlocks; // crc mismatches
+	long missingBlocks; // sequence gaps, lost by the writer while logging
+	long bytes;
+	int64_t timeUs;
+} export_result_t;
+
+static esp_err_t exportFile(FILE *in, FILE *out, bool fast, export_result_t *result){
+	memset(result, 0, sizeof(export_result_t));
+	int64_t startUs = esp_timer_get_time();
+	
+	log_file_header_t header;
+	if(logReadExact(in, &header, sizeof(header)) == false || header.magic != LOG_FILE_MAGIC){
+		ESP_LOGE(TAG, "Not a log file");
+		return ESP_ERR_INVALID_ARG;
+	}
+	if(esp_rom_crc32_le(0, (uint8_t *)&header, offsetof(log_file_header_t, crc)) != header.crc){
+		ESP_LOGE(TAG, "Log header crc mismatch");
+		return ESP_ERR_INVALID_CRC;
+	}
+	if(header.version > LOG_FORMAT_VERSION){ // older versions only leave sections out
+		ESP_LOGE(TAG, "Log format %u is newer than this firmware", header.version);
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	size_t captureBytes = LOG_BLOCK_HEADER_BYTES + header.framesPerBlock * header.recordBytes;
+	if(header.channelCount > LOG_MAX_CHANNELS || header.blockBytes > MAX_BLOCK_BYTES || header.blockBytes != sizeof(log_block_prefix_t) + captureBytes + sizeof(uint32_t)
+		|| header.recordBytes < 3 + (header.channelCount * 3 + 1) / 2){
+		ESP_LOGE(TAG, "Unsupported log layout");
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	fseek(in, header.headerBytes, SEEK_SET); // later versions may add to the header
+	
+	uint8_t *block = malloc(header.blockBytes + captureBytes); // a file block, then room to unpack into
+	if(block == NULL){
+		return ESP_ERR_NO_MEM;
+	}
+	uint8_t *unpacked = &block[header.blockBytes];
+	if(fast){
+		csvBuffer = malloc(SD_CLUSTER_BYTES + CSV_ROW_BYTES);
+		if(csvBuffer == NULL){
+			free(block);
+			return ESP_ERR_NO_MEM;
+		}
+		setvbuf(out, NULL, _IONBF, 0); // whole clusters go straight to fatfs
+	}
+	csvFile = out;
+	csvFast = fast;
+	csvUsed = 0;
+	
+	csvHeader("timeUs", header.channelMask, "");
+	csvText(", lateUs\n");
+	
+	uint32_t expected = 0;
+	uint32_t magic;
+	while(logReadExact(in, &magic, sizeof(magic))){
+		if(magic == LOG_PEAK_MAGIC){
+			exportPeaks(in, &header);
+			break;
+		}
+		if(magic == LOG_SUMMARY_MAGIC){
+			break; // no peak table, the summary is only read by log-plot
+		}
+		uint32_t sequence;
+		uint8_t *capture;
+		if(magic == LOG_PACKED_MAGIC){
+			esp_err_t err = readPacked(in, &header, block, unpacked, &sequence);
+			if(err == ESP_ERR_INVALID_SIZE){
+				break; // cut short, the run did not close the file
+			}
+			if(err != ESP_OK){
+				result->badBlocks++;
+				continue;
+			}
+			capture = unpacked;
+		}else if(magic == LOG_BLOCK_MAGIC){
+			memcpy(block, &magic, sizeof(magic));
+			if(logReadExact(in, &block[sizeof(magic)], header.blockBytes - sizeof(magic)) == false){
+				break; // cut short, the run did not close the file
+			}
+	
+			uint32_t crc;
+			memcpy(&crc, &block[header.blockBytes - sizeof(crc)], sizeof(crc));
+			if(esp_rom_crc32_le(0, block, header.blockBytes - sizeof(crc)) != crc){
+				result->badBlocks++;
+				continue;
+			}
+			log_block_prefix_t prefix;
+			memcpy(&prefix, block, sizeof(prefix));
+			sequence = prefix.sequence;
+			capture = &block[sizeof(prefix)];
+		}else{
+			ESP_LOGW(TAG, "Unknown section, export stopped");
+			break;
+		}
+		if(sequence > expected){
+			result->missingBlocks += sequence - expected;
+		}
+		expected = sequence + 1;
+	
+		result->rows += exportBlock(&header, capture);
+	}
+	
+	if(fast){
+		csvFlush(true);
+		free(csvBuffer);
+		csvBuffer = NULL;
+	}
+	fflush(out);
+	result->bytes = ftell(out);
+	result->timeUs = esp_timer_get_time() - startUs;
+	free(block);
+	return ESP_OK;
+}
+
+static esp_err_t exportPath(int index, const char *inPath, const char *outPath, bool fast, export_result_t *result){
+	FILE *in = fopen(inPath, "r");
+	if(in == NULL){
+		ESP_LOGE(TAG, "No log %d", index);
+		return ESP_ERR_NOT_FOUND;
+	}
+	FILE *out = fopen(outPath, "w");
+	if(out == NULL){
+		ESP_LOGE(TAG, "Failed to open %s for writing", outPath);
+		fclose(in);
+		return ESP_FAIL;
+	}
+	esp_err_t err = exportFile(in, out, fast, result);
+	fclose(out);
+	fclose(in);
+	
+	if(err == ESP_OK && (result->badBlocks != 0 || result->missingBlocks != 0)){
+		ESP_LOGW(TAG, "%ld blocks failed their crc, %ld blocks were never written", result->badBlocks, result->missingBlocks);
+	}
+	return err;
+}
+
+esp_err_t exportLogCsv(int index){
+	char inPath[50];
+	char outPath[50];
+	sprintf(inPath, "%s/log%d.bin", SD_MOUNT_POINT, index);
+	sprintf(outPath, "%s/log%d.csv", SD_MOUNT_POINT, index);
+	
+	export_result_t result;
+	esp_err_t err = exportPath(index, inPath, outPath, true, &result);
+	if(err == ESP_OK){
+		ESP_LOGI(TAG, "%s, %ld rows in %lld ms", outPath, result.rows, result.timeUs / 1000);
+	}
+	return err;
+}
+
+// Stuff for the console
+static struct {
+	struct arg_int *index; // log<index>.bin
+	struct arg_lit *benchmark; // also export through stdio and compare
+    struct arg_end *end;
+} export_args;
+
+static void printResult(const char *name, export_result_t *result){
+	double seconds = result->timeUs / 1000000.0;
+	printf("%-8s %ld rows, %ld KB in %.2f s, %.2f MB/s\n",
+		name, result->rows, result->bytes / 1024, seconds, (result->bytes / (1024.0 * 1024.0)) / seconds);
+}
+
+static int exportCommand(int argc, char **argv){
+	int nerrors = arg_parse(argc, argv, (void  **) &export_args);
+	if (nerrors != 0) {
+        arg_print_errors(stderr, export_args.end, argv[0]);
+        return 1;
+    }
+	if(loggingIsArmed()){
+		ESP_LOGE(TAG, "A run is armed, export once it is written");
+		return 1;
+	}
+	int index = export_args.index->ival[0];
+	if(index < 0){
+		ESP_LOGE(TAG, "Invalid log index.");
+		return 1;
+	}
+	
+	if(export_args.benchmark->count == 0){
+		return (exportLogCsv(index) == ESP_OK) ? 0 : 1;
+	}
+	
+	// Same log both ways, the stdio copy is deleted afterwards
+	char inPath[50];
+	char fastPath[50];
+	char stdioPath[50];
+	sprintf(inPath, "%s/log%d.bin", SD_MOUNT_POINT, index);
+	sprintf(fastPath, "%s/log%d.csv", SD_MOUNT_POINT, index);
+	sprintf(stdioPath, "%s/bench.csv", SD_MOUNT_POINT);
+	
+	export_result_t fast;
+	export_result_t stdio;
+	if(exportPath(index, inPath, fastPath, true, &fast) != ESP_OK || exportPath(index, inPath, stdioPath, false, &stdio) != ESP_OK){
+		return 1;
+	}
+	unlink(stdioPath);
+	
+	printResult("fast", &fast);
+	printResult("fprintf", &stdio);
+	printf("%.1fx faster\n", (double)stdio.timeUs / fast.timeUs);
+	return 0;
+}
+
+void exportRegisterCommands(){
+	export_args.index = arg_int1(NULL, NULL, "<index>", "Log number, converts log<index>.bin to log<index>.csv");
+	export_args.benchmark = arg_lit0("b", NULL, "Also export through fprintf and compare dump time and MB/s");
+	export_args.end = arg_end(2);
+	
+	const esp_console_cmd_t cmd_export = {
+		.command = "log-export",
+		.help = "Convert a binary log on the sd card to csv.",
+		.hint = NULL,
+		.func = &exportCommand,
+		.argtable = &export_args
+	};
+	
+	ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_export));
+}
@@ -0,0 +1,26 @@
+/********************************************************************************
+ * File Name          : export.h
+ * Author             : Jack Shaver
+ * Date               : 10/17/2026
+ * Description        : Log Export Header
+ ********************************************************************************/
+
+#ifndef export_h
+#define export_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "esp_err.h"
+
+// Converts log<index>.bin on the card to log<index>.csv, same columns as the old csv logs
+extern esp_err_t exportLogCsv(int index);
+
+extern void exportRegisterCommands();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,383 @@
+/********************************************************************************
+ * File Name          : flashLog.c
+ * Author             : Jack Shaver
+ * Date               : 10/17/2026
+ * Description        : Internal Flash Log Source
+ ********************************************************************************/
+
+#include "flashLog.h"
+#include "logging.h"
+#include "sd.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h> // offsetof
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+#include "esp_console.h"
+#include "argtable3/argtable3.h" // command creation
+
+#define FLASH_PARTITION_LABEL "logs"
+#define FLASH_PARTITION_SUBTYPE 0x40 // first custom data subtype, see partitions.csv
+#define FLASH_SECTOR_BYTES 4096 // erase size
+#define FLASH_DATA_OFFSET (2 * FLASH_SECTOR_BYTES) // runs start after the two table copies
+#define FLASH_MAP_BYTES (1024 * 1024) // mapped at a time when a run is read back
+#define FLASH_MAGIC 0x534C4655 // "UFLS"
+#define FLASH_RUNS 32
+
+static const char *TAG = "flashLog";
+
+// The partition holds two copies of the run table, then the runs laid end to end
+// Like the raw sd region, the copy with the higher sequence wins and the other one is written next
+// Every flash write or erase stalls both cores while the cache is off, a sector erase for tens of ms, so the whole reservation
+// is erased when the run opens, before sampling starts, and nothing is erased between the trigger and the close
+typedef enum{
+	flashFree, flashWriting, flashDone
+} flash_state_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t number; // counts up with every run, shown by flash-log
+	uint32_t offset; // from the start of the partition
+	uint32_t bytes;
+	uint32_t span; // reserved, whole sectors
+	uint8_t state;
+	uint8_t exported; // copied to the sd card
+	uint16_t reserved;
+	log_catalog_record_t record; // from flashCatalogRun, goes into the card catalog once the run is copied over
+} flash_run_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t nextOffset;
+	uint32_t nextNumber;
+	flash_run_t runs[FLASH_RUNS];
+	uint32_t crc;
+} flash_table_t;
+
+_Static_assert(sizeof(flash_table_t) <= FLASH_SECTOR_BYTES, "the run table has to fit a sector");
+
+static const esp_partition_t *partition = NULL;
+static flash_table_t table;
+static int openRun = -1; // slot being written
+static int closedRun = -1; // slot of the last run closed, flashCatalogRun fills in its record
+static uint32_t writeOffset = 0; // next byte of the open run
+static uint8_t pageBuffer[FLASH_SECTOR_BYTES]; // writes go out a sector at a time
+static size_t pageUsed = 0;
+
+static void tableWrite(){
+	table.sequence++;
+	table.crc = esp_rom_crc32_le(0, (uint8_t *)&table, offsetof(flash_table_t, crc));
+	size_t copy = (table.sequence % 2) * FLASH_SECTOR_BYTES;
+	esp_partition_erase_range(partition, copy, FLASH_SECTOR_BYTES);
+	esp_partition_write(partition, copy, &table, sizeof(table));
+}
+
+static bool tableRead(size_t copy, flash_table_t *read){
+	if(esp_partition_read(partition, copy * FLASH_SECTOR_BYTES, read, sizeof(flash_table_t)) != ESP_OK){
+		return false;
+	}
+	return read->magic == FLASH_MAGIC && read->crc == esp_rom_crc32_le(0, (uint8_t *)read, offsetof(flash_table_t, crc));
+}
+
+// A run still marked writing was cut short, it ends at the first sector that was never written
+static void recoverRun(flash_run_t *run){
+	uint32_t bytes = 0;
+	uint8_t head[16];
+	uint8_t erased[16];
+	memset(erased, 0xFF, sizeof(erased));
+	while(bytes < run->span){
+		esp_partition_read(partition, run->offset + bytes, head, sizeof(head));
+		if(memcmp(head, erased, sizeof(head)) == 0){
+			break;
+		}
+		bytes += FLASH_SECTOR_BYTES;
+	}
+	run->bytes = bytes;
+	run->state = flashDone;
+	ESP_LOGW(TAG, "Run %lu was cut short, kept %lu KB", run->number, bytes / 1024);
+}
+
+void flashLogInit(){
+	partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, FLASH_PARTITION_SUBTYPE, FLASH_PARTITION_LABEL);
+	if(partition == NULL){
+		ESP_LOGE(TAG, "No %s partition, flash logging is off", FLASH_PARTITION_LABEL);
+		return;
+	}
+
+	flash_table_t copies[2];
+	bool valid[2] = {tableRead(0, &copies[0]), tableRead(1, &copies[1])};
+	if(valid[0] || valid[1]){
+		int newest = (valid[0] && (valid[1] == false || copies[0].sequence > copies[1].sequence)) ? 0 : 1;
+		table = copies[newest];
+	}else{
+		memset(&table, 0, sizeof(table));
+		table.magic = FLASH_MAGIC;
+		table.nextOffset = FLASH_DATA_OFFSET;
+		tableWrite();
+	}
+
+	bool recovered = false;
+	for(int r = 0; r < FLASH_RUNS; r++){
+		if(table.runs[r].state == flashWriting){
+			recoverRun(&table.runs[r]);
+			recovered = true;
+		}
+	}
+	if(recovered){
+		tableWrite();
+	}
+	ESP_LOGI(TAG, "%lu KB flash log partition", partition->size / 1024);
+}
+
+// Only runs already on the card are given up for a new one, the rest have to be copied or forgotten with flash-log first
+static bool runInTheWay(flash_run_t *run){
+	if(run->exported == false){
+		ESP_LOGE(TAG, "Run %lu is in the way and not on the card yet, copy it with flash-log -x or forget the runs with flash-log -e", run->number);
+		return true;
+	}
+	return false;
+}
+
+esp_err_t flashOpenLog(size_t expectedBytes){
+	if(partition == NULL){
+		return ESP_ERR_NOT_FOUND;
+	}
+	uint32_t span = ((expectedBytes + FLASH_SECTOR_BYTES - 1) / FLASH_SECTOR_BYTES) * FLASH_SECTOR_BYTES;
+	if(span > partition->size - FLASH_DATA_OFFSET){
+		span = partition->size - FLASH_DATA_OFFSET; // the run stops when the partition is full
+	}
+	uint32_t start = table.nextOffset;
+	if(start + span > partition->size){
+		start = FLASH_DATA_OFFSET;
+	}
+
+	// A free slot, or the oldest run already on the card
+	int slot = -1;
+	for(int r = 0; r < FLASH_RUNS; r++){
+		flash_run_t *run = &table.runs[r];
+		if(run->state == flashFree){
+			slot = r;
+			break;
+		}
+		if(run->exported && (slot < 0 || run->number < table.runs[slot].number)){
+			slot = r;
+		}
+	}
+	if(slot < 0){
+		ESP_LOGE(TAG, "All %d runs are waiting to be copied to the card, copy them with flash-log -x or forget them with flash-log -e", FLASH_RUNS);
+		return ESP_ERR_NO_MEM;
+	}
+	for(int r = 0; r < FLASH_RUNS; r++){
+		flash_run_t *run = &table.runs[r];
+		if(run->state != flashFree && start < run->offset + run->span && run->offset < start + span && runInTheWay(run)){
+			return ESP_ERR_NO_MEM;
+		}
+	}
+
+	// The runs given up are dropped from the table before their data goes, a reset part way through never leaves a run pointing at erased flash
+	for(int r = 0; r < FLASH_RUNS; r++){
+		flash_run_t *run = &table.runs[r];
+		if(run->state != flashFree && (r == slot || (start < run->offset + run->span && run->offset < start + span))){
+			run->state = flashFree;
+		}
+	}
+	tableWrite();
+	ESP_LOGI(TAG, "Erasing %lu KB of flash for the run", span / 1024);
+	esp_err_t err = esp_partition_erase_range(partition, start, span);
+	if(err != ESP_OK){
+		ESP_LOGE(TAG, "Erase failed (%s)", esp_err_to_name(err));
+		return err;
+	}
+
+	flash_run_t *run = &table.runs[slot];
+	run->number = table.nextNumber++;
+	run->offset = start;
+	run->bytes = 0;
+	run->span = span;
+	run->state = flashWriting;
+	run->exported = false;
+	memset(&run->record, 0, sizeof(run->record)); // runs cut short by a reset are never cataloged
+	table.nextOffset = start + span;
+	tableWrite();
+
+	openRun = slot;
+	writeOffset = start;
+	pageUsed = 0;
+	ESP_LOGI(TAG, "Logging run %lu to flash, %lu KB reserved", run->number, span / 1024);
+	return ESP_OK;
+}
+
+// The span was erased at the open, a write only stalls the cache for the page program
+static void writePage(size_t bytes){
+	flash_run_t *run = &table.runs[openRun];
+	if(writeOffset + bytes > run->offset + run->span){
+		ESP_LOGE(TAG, "Run is past its reservation, data dropped");
+		return;
+	}
+	esp_partition_write(partition, writeOffset, pageBuffer, bytes);
+	writeOffset += bytes;
+	run->bytes += bytes;
+}
+
+void flashWriteLog(const void *data, size_t bytes){
+	if(openRun < 0){
+		return;
+	}
+	const uint8_t *next = data;
+	while(bytes != 0){
+		size_t chunk = FLASH_SECTOR_BYTES - pageUsed;
+		if(chunk > bytes){
+			chunk = bytes;
+		}
+		memcpy(&pageBuffer[pageUsed], next, chunk);
+		pageUsed += chunk;
+		next += chunk;
+		bytes -= chunk;
+
+		if(pageUsed == FLASH_SECTOR_BYTES){
+			writePage(FLASH_SECTOR_BYTES);
+			pageUsed = 0;
+		}
+	}
+}
+
+void flashCloseLog(){
+	if(openRun < 0){
+		return;
+	}
+	if(pageUsed != 0){
+		writePage(pageUsed);
+		pageUsed = 0;
+	}
+	table.runs[openRun].state = flashDone;
+	table.nextOffset = ((writeOffset + FLASH_SECTOR_BYTES - 1) / FLASH_SECTOR_BYTES) * FLASH_SECTOR_BYTES; // the unused reservation goes back
+	tableWrite();
+	closedRun = openRun;
+	openRun = -1;
+}
+
+void flashCatalogRun(const log_catalog_record_t *record){
+	if(closedRun < 0){
+		return;
+	}
+	table.runs[closedRun].record = *record;
+	tableWrite();
+	closedRun = -1;
+}
+
+void flashDiscardLog(){
+	if(openRun < 0){
+		return;
+	}
+	table.runs[openRun].state = flashFree;
+	table.nextOffset = table.runs[openRun].offset;
+	tableWrite();
+	openRun = -1;
+	closedRun = -1;
+}
+
+// Read back through the cache, a window at a time so a long run never needs all of the mmu pages at once
+static esp_err_t exportRun(flash_run_t *run){
+	esp_err_t err = sdOpenLog("log", "bin", run->bytes);
+	if(err != ESP_OK){
+		return err;
+	}
+	for(uint32_t done = 0; done < run->bytes; done += FLASH_MAP_BYTES){
+		uint32_t window = run->bytes - done;
+		if(window > FLASH_MAP_BYTES){
+			window = FLASH_MAP_BYTES;
+		}
+		const void *mapped;
+		esp_partition_mmap_handle_t handle;
+		err = esp_partition_mmap(partition, run->offset + done, window, ESP_PARTITION_MMAP_DATA, &mapped, &handle);
+		if(err != ESP_OK){
+			ESP_LOGE(TAG, "Mapping run %lu failed (%s)", run->number, esp_err_to_name(err));
+			sdDiscardLog();
+			return err;
+		}
+		sdWriteLog(mapped, window);
+		esp_partition_munmap(handle);
+	}
+	sdCloseLog();
+
+	// The record was made when the run closed, only the log number is new
+	int index = sdLastLogIndex();
+	if(run->record.magic == LOG_CATALOG_MAGIC && index >= 0){
+		log_catalog_record_t record = run->record;
+		record.index = index;
+		record.crc = esp_rom_crc32_le(0, (uint8_t *)&record, offsetof(log_catalog_record_t, crc));
+		sdCatalogWrite(index, &record);
+	}
+
+	run->exported = true;
+	tableWrite();
+	return ESP_OK;
+}
+
+// Stuff for the console
+static struct {
+	struct arg_int *export; // copy a run to the sd card
+	struct arg_lit *erase; // forget every run
+    struct arg_end *end;
+} flash_args;
+
+static int flashLogCommand(int argc, char **argv){
+	int nerrors = arg_parse(argc, argv, (void  **) &flash_args);
+	if (nerrors != 0) {
+        arg_print_errors(stderr, flash_args.end, argv[0]);
+        return 1;
+    }
+	if(partition == NULL){
+		ESP_LOGE(TAG, "No %s partition", FLASH_PARTITION_LABEL);
+		return 1;
+	}
+	if(openRun >= 0 || loggingIsArmed()){
+		ESP_LOGE(TAG, "A run is being written");
+		return 1;
+	}
+
+	if(flash_args.erase->count != 0){
+		memset(table.runs, 0, sizeof(table.runs));
+		table.nextOffset = FLASH_DATA_OFFSET;
+		tableWrite();
+		return 0;
+	}
+
+	if(flash_args.export->count != 0){
+		uint32_t number = flash_args.export->ival[0];
+		for(int r = 0; r < FLASH_RUNS; r++){
+			if(table.runs[r].state == flashDone && table.runs[r].number == number){
+				return (exportRun(&table.runs[r]) == ESP_OK) ? 0 : 1;
+			}
+		}
+		ESP_LOGE(TAG, "No run %lu in flash", number);
+		return 1;
+	}
+
+	for(int r = 0; r < FLASH_RUNS; r++){
+		flash_run_t *run = &table.runs[r];
+		if(run->state == flashDone){
+			printf("run %lu: %lu KB at 0x%06lx%s\n", run->number, run->bytes / 1024, partition->address + run->offset, run->exported ? ", on the card" : "");
+		}
+	}
+	return 0;
+}
+
+void flashLogRegisterCommands(){
+	flash_args.export = arg_int0("x", NULL, "<run>", "Copy a run to the sd card as the next log file");
+	flash_args.erase = arg_lit0("e", NULL, "Forget every run in the partition");
+	flash_args.end = arg_end(2);
+
+	const esp_console_cmd_t cmd_flash = {
+		.command = "flash-log",
+		.help = "List the runs logged to internal flash.",
+		.hint = NULL,
+		.func = &flashLogCommand,
+		.argtable = &flash_args
+	};
+
+	ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_flash));
+}
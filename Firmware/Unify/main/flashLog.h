@@ -0,0 +1,36 @@
+/********************************************************************************
+ * File Name          : flashLog.h
+ * Author             : Jack Shaver
+ * Date               : 10/17/2026
+ * Description        : Internal Flash Log Header
+ ********************************************************************************/
+
+#ifndef flashLog_h
+#define flashLog_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "logging.h" // catalog records
+
+extern void flashLogInit(); // finds the logs partition, runs cut short by a reset are closed here
+
+// Same calls as the sd log, one run open at a time, the partition wraps over runs already copied to the card
+// flashOpenLog erases the whole reservation before it returns and refuses with ESP_ERR_NO_MEM rather than overwrite a run that is not on the card
+extern esp_err_t flashOpenLog(size_t expectedBytes);
+extern void flashWriteLog(const void *data, size_t bytes);
+extern void flashCloseLog();
+extern void flashDiscardLog();
+extern void flashCatalogRun(const log_catalog_record_t *record); // kept with the last closed run until it is copied to the card
+
+extern void flashLogRegisterCommands();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,36 +8,132 @@
 #include "logging.h"
 #include "spi.h"
 #include "sd.h"
+#include "flashLog.h"
+#include "codec.h"
+#include "summary.h"
 #include "leds.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <stddef.h> // offsetof
+#include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
-#include "esp_log.h"
 #include "esp_console.h"
 #include "argtable3/argtable3.h" // command creation
 
+#include "driver/gptimer.h"
+#include "esp_heap_caps.h" // capture arena lives in the psram
+#include "esp_app_desc.h" // build info for the log header
+#include "esp_rom_crc.h"
+#include "esp_err.h"
+
 #define MIN_FREQUENCY 1
-#define MAX_FREQUENCY 100 // Could increase this by running on a timer on second core, it times out the scheduler if 1000
-#define DEFAULT_FREQUENCY 100
+#define MAX_FREQUENCY 10000 // Paced by a gptimer on the second core, not the 100Hz scheduler tick
+#define DEFAULT_FREQUENCY 200
 #define MIN_DURATION 1
-#define MAX_DURATION 120
+#define MAX_DURATION 3600 // streamed to the card while sampling, only bounded by card space
 #define DEFAULT_DURATION 30
+#define DEFAULT_AVERAGING 8
+#define DEFAULT_PEAK_HOLD 100 // ms
+#define DEFAULT_PRE_TRIGGER 2000 // ms, baseline for the load cell tare
+#define DEFAULT_TRIGGER_CHANNEL -1 // thresholds depend on the load cell calibration, off until they are set
+#define DEFAULT_TRIGGER_THRESHOLD 0x2000
+#define DEFAULT_RELEASE_THRESHOLD 0x1000
+#define DEFAULT_RELEASE_HOLD 500 // ms
+#define DEFAULT_HEARTBEAT 1000 // ms
+#define MAX_PEAK_VALUES 2400 // total across all channels, for each of min and max
+
+#define INTERNAL_RESERVE (64 * 1024) // left for wifi, dma and stacks when the arena has to come from internal ram
+#define BLOCK_FRAMES LOGGING_BLOCK_FRAMES // most frames sharing one 64 bit block time
+#define BLOCK_SPAN_US 32768 // half of the 16 bit offset range, the rest covers late samples
+#define STREAM_RING_BYTES (32 * 1024) // live blocks shared by every consumer, allocated once
+#define STREAM_POLL_MS 100 // the writer also wakes up on its own in case a notification is missed
+#define STREAM_SYNC_US 1000000 // how often the writer forces data onto the card
+#define STREAM_CORE 0 // the writer shares core 0 with wifi and the console, acquisition keeps core 1
+#define VOLTS_PER_CODE ((5.0f * 16) / 65535) // 12 bit samples, same scale as spiAdcReadFloat
+#define MAX_BLOCK_BYTES (LOG_BLOCK_HEADER_BYTES + BLOCK_FRAMES * (LOG_RECORD_HEADER_BYTES + (LOG_MAX_CHANNELS * 3 + 1) / 2))
+#define TIMER_RESOLUTION_HZ 1000000 // 1 tick = 1us, lateness is measured in timer ticks
+#define LOGGING_CORE 1 // Keep acquisition off of core 0, wifi and the console live there
 
-static uint8_t sequencerMask = 0; // currently not used
+static const char *TAG = "logging";
+
+static uint8_t sequencerMask = 0x01; // adc channels in the sequence, bit 0 is load cell 1
+static int channelCount = 1;
 static int frequency = DEFAULT_FREQUENCY;
 static int duration = DEFAULT_DURATION;
+static uint8_t averaging[LOG_MAX_CHANNELS] = {
+	DEFAULT_AVERAGING, DEFAULT_AVERAGING, DEFAULT_AVERAGING, DEFAULT_AVERAGING,
+	DEFAULT_AVERAGING, DEFAULT_AVERAGING, DEFAULT_AVERAGING, DEFAULT_AVERAGING
+};
+static int maxFrequency = MAX_FREQUENCY;
+static int peakHoldMs = DEFAULT_PEAK_HOLD;
+static int preTriggerMs = DEFAULT_PRE_TRIGGER;
+static int triggerChannel = DEFAULT_TRIGGER_CHANNEL;
+static uint16_t triggerThreshold = DEFAULT_TRIGGER_THRESHOLD;
+static uint16_t releaseThreshold = DEFAULT_RELEASE_THRESHOLD;
+static int releaseHoldMs = DEFAULT_RELEASE_HOLD;
+static bool rawSectors = false; // raw region instead of a file, see sdOpenRawLog
+static bool flashTarget = false; // internal flash logs partition instead of the card
+static bool packBlocks = false; // blocks go through the codec on core 0
+static uint16_t deadband[LOG_MAX_CHANNELS] = {0};
+static int64_t heartbeatUs = DEFAULT_HEARTBEAT * 1000LL;
 
 static void loggingTask(void *arg);
+static void sdWriterTask(void *arg);
+static esp_err_t allocateArena();
+static void freeArena();
+static void streamRingInit();
+static long expectedFrames();
+static uint8_t *arena = NULL; // sized for the run, allocated when it is armed and freed once the file is closed
 SemaphoreHandle_t loggingTaskBlockSemaphore = NULL;
+static TaskHandle_t loggingTaskHandle = NULL;
+static gptimer_handle_t loggingTimer = NULL;
+
+// Shared between the logging task and whoever arms, triggers and stops it
+static atomic_bool armed = false; // from loggingArm until the file is closed
+static atomic_bool stop = false;
+static atomic_bool triggered = false; // set by loggingTrigger, the logging task picks it up on the next sample
+
+// Control messages from the capture to the sd writer task, the blocks themselves go through the stream ring
+typedef enum{
+	streamOpen, streamHistory, streamClose, streamDiscard
+} streamCommand;
+
+typedef struct{
+	streamCommand command;
+	long value; // expected file bytes with streamOpen, pre trigger ring blocks filled with streamHistory
+} streamMessage_t;
+
+static QueueHandle_t streamQueue = NULL;
+static SemaphoreHandle_t streamDone = NULL; // given once the file is closed
+static esp_err_t streamStatus = ESP_OK; // result of the command streamDone answers, set by the writer before it gives it
+static SemaphoreHandle_t armDone = NULL; // given by the logging task once the log is open, or the run has been dropped
+static esp_err_t armStatus = ESP_OK;
+static TaskHandle_t sdWriterTaskHandle = NULL;
+
+// Matches the bit order of makeSequencerMask, which matches the adc channel numbers
+static const char *channelNames[LOG_MAX_CHANNELS] = {
+	"loadCell1", "loadCell2", "loadCell3", 
+	"thermistor1", "thermistor2", "thermistor3", 
+	"pressureTransducer1", "pressureTransducer2"
+};
 
 void loggingInit(){
 	loggingTaskBlockSemaphore = xSemaphoreCreateBinary();   
-	xTaskCreate(loggingTask, "loggingTask", 4096, NULL, 8, NULL);
+	xTaskCreatePinnedToCore(loggingTask, "loggingTask", 4096, NULL, 8, &loggingTaskHandle, LOGGING_CORE);
+	
+	streamRingInit();
+	streamQueue = xQueueCreate(4, sizeof(streamMessage_t));
+	streamDone = xSemaphoreCreateBinary();
+	armDone = xSemaphoreCreateBinary();
+	xTaskCreatePinnedToCore(sdWriterTask, "sdWriterTask", 6144, NULL, 4, &sdWriterTaskHandle, STREAM_CORE);
 }
 
 logging_config_t loggingDefaultConfig(){
@@ -50,9 +146,23 @@ logging_config_t loggingDefaultConfig(){
 		.thermistor3 = false,
 		.pressureTransducer1 = false,
 		.pressureTransducer2 = false,
-		//.frequencyHz = DEFAULT_FREQUENCY,
-		.frequencyHz = 200,
-		.durationSeconds = DEFAULT_DURATION 
+		.frequencyHz = DEFAULT_FREQUENCY,
+		.durationSeconds = DEFAULT_DURATION,
+		.averaging = {
+			DEFAULT_AVERAGING, DEFAULT_AVERAGING, DEFAULT_AVERAGING, DEFAULT_AVERAGING,
+			DEFAULT_AVERAGING, DEFAULT_AVERAGING, DEFAULT_AVERAGING, DEFAULT_AVERAGING
+		},
+		.peakHoldMs = DEFAULT_PEAK_HOLD,
+		.preTriggerMs = DEFAULT_PRE_TRIGGER,
+		.triggerChannel = DEFAULT_TRIGGER_CHANNEL,
+		.triggerThreshold = DEFAULT_TRIGGER_THRESHOLD,
+		.releaseThreshold = DEFAULT_RELEASE_THRESHOLD,
+		.releaseHoldMs = DEFAULT_RELEASE_HOLD,
+		.rawSectors = false,
+		.flashTarget = false,
+		.packBlocks = false,
+		.deadband = {0},
+		.heartbeatMs = DEFAULT_HEARTBEAT
 	};
 	
 	return temp;
@@ -71,80 +181,1378 @@ static uint8_t makeSequencerMask(logging_config_t cfg){
 	return temp;
 }
 
-void loggingConfig(logging_config_t cfg){
-	sequencerMask = makeSequencerMask(cfg);
-	frequency = cfg.frequencyHz;
-	if(frequency < MIN_FREQUENCY){
-		frequency = MIN_FREQUENCY;
+// The arena is a run of fixed size blocks, each one a header and up to framesPerBlock records
+// Header: 64 bit esp_timer time of the first frame, 16 bit frame count
+// Record: 16 bit us offset from the block time, 8 bit lateness, then the samples packed 12 bits each, two per 3 bytes
+// Blocks only span BLOCK_SPAN_US so the offsets fit with room left for late samples
+static int framesPerBlockFor(int frequencyHz){
+	long frames = BLOCK_SPAN_US / (TIMER_RESOLUTION_HZ / frequencyHz);
+	if(frames < 1){
+		frames = 1;
+	}
+	if(frames > BLOCK_FRAMES){
+		frames = BLOCK_FRAMES;
+	}
+	return frames;
+}
+
+static size_t recordBytesFor(int channels){
+	return LOG_RECORD_HEADER_BYTES + (channels * 3 + 1) / 2;
+}
+
+static size_t blockBytesFor(int channels, int frequencyHz){
+	return LOG_BLOCK_HEADER_BYTES + framesPerBlockFor(frequencyHz) * recordBytesFor(channels);
+}
+
+// One block more than the window, the block being written when the trigger lands is only partly history
+static long ringBlocksFor(int frequencyHz, int preTrigger){
+	long frames = ((long)preTrigger * frequencyHz) / 1000;
+	if(frames == 0){
+		return 0;
+	}
+	int perBlock = framesPerBlockFor(frequencyHz);
+	return (frames + perBlock - 1) / perBlock + 1;
+}
+
+// Bytes of capture arena a run needs, only the pre trigger ring, the burn streams through the stream ring
+static size_t arenaBytes(int channels, int frequencyHz, int durationSeconds, int preTrigger){
+	return ringBlocksFor(frequencyHz, preTrigger) * blockBytesFor(channels, frequencyHz);
+}
+
+// Largest arena that can be allocated right now, internal ram keeps a reserve for wifi, dma and stacks
+static size_t arenaBudget(){
+	if(heap_caps_get_total_size(MALLOC_CAP_SPIRAM) != 0){
+		return heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
 	}
-	if(frequency > MAX_FREQUENCY){
-		frequency = MAX_FREQUENCY;
+	size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+	return (largest > INTERNAL_RESERVE) ? largest - INTERNAL_RESERVE : 0;
+}
+
+// Everything is checked before anything is applied, a rejected config leaves the previous one in place
+esp_err_t loggingConfig(logging_config_t cfg){
+	if(atomic_load(&armed)){ // the layout of a run has to stay fixed until its file is closed
+		ESP_LOGE(TAG, "Config rejected, a run is armed");
+		return ESP_ERR_INVALID_STATE;
+	}
+	
+	uint8_t mask = makeSequencerMask(cfg);
+	if(mask == 0){
+		ESP_LOGW(TAG, "No channels selected, logging load cell 1");
+		mask = 0x01;
+	}
+	
+	int trigger = cfg.triggerChannel;
+	if(trigger >= LOG_MAX_CHANNELS){
+		ESP_LOGW(TAG, "Invalid trigger channel, using manual triggers");
+		trigger = -1;
 	}
-	duration = cfg.durationSeconds;
-	if(duration < MIN_DURATION){
-		duration = MIN_DURATION;
+	if(trigger >= 0 && (mask & (1 << trigger)) == 0){
+		ESP_LOGW(TAG, "Trigger channel %s added to the log", channelNames[trigger]);
+		mask |= 1 << trigger;
 	}
-	if(duration > MAX_DURATION){
-		duration = MAX_DURATION;
+	int count = 0;
+	for(int i = 0; i < LOG_MAX_CHANNELS; i++){
+		if(mask & (1 << i)){
+			count++;
+		}
+	}
+	
+	// More averaging means longer conversions, the sequence rate drops with it
+	int maxRate = spiAdcMaxSequenceRate(mask, cfg.averaging);
+	if(maxRate > MAX_FREQUENCY){
+		maxRate = MAX_FREQUENCY;
 	}
+	ESP_LOGI(TAG, "%d channels, max sample rate %dHz", count, maxRate);
 	
-	//spiAdcSetSequence(sequencerMask);
+	int rate = cfg.frequencyHz;
+	if(rate < MIN_FREQUENCY){
+		rate = MIN_FREQUENCY;
+	}
+	if(rate > maxRate){
+		ESP_LOGW(TAG, "%dHz is above the max sample rate, logging at %dHz", rate, maxRate);
+		rate = maxRate;
+	}
+	int seconds = cfg.durationSeconds;
+	if(seconds < MIN_DURATION){
+		seconds = MIN_DURATION;
+	}
+	if(seconds > MAX_DURATION){
+		seconds = MAX_DURATION;
+	}
+	int preTrigger = (cfg.preTriggerMs < 0) ? 0 : cfg.preTriggerMs;
+	
+	// Held samples still take their full 12 bits in the record, only the codec turns a repeated value into a few bits
+	for(int i = 0; i < LOG_MAX_CHANNELS; i++){
+		if((mask & (1 << i)) && cfg.deadband[i] != 0 && cfg.packBlocks == false){
+			ESP_LOGE(TAG, "Config rejected, a deadband on %s saves nothing unless packBlocks is set", channelNames[i]);
+			return ESP_ERR_INVALID_ARG;
+		}
+	}
+	
+	size_t needed = arenaBytes(count, rate, seconds, preTrigger);
+	size_t budget = arenaBudget();
+	if(needed > budget){
+		ESP_LOGE(TAG, "Config rejected, %d channels at %dHz for %ds + %dms needs %u KB, %u KB available", 
+			count, rate, seconds, preTrigger, (unsigned)(needed / 1024), (unsigned)(budget / 1024));
+		return ESP_ERR_NO_MEM;
+	}
+	
+	sequencerMask = mask;
+	channelCount = count;
+	maxFrequency = maxRate;
+	frequency = rate;
+	duration = seconds;
+	preTriggerMs = preTrigger;
+	memcpy(averaging, cfg.averaging, sizeof(averaging));
+	
+	triggerChannel = trigger;
+	triggerThreshold = cfg.triggerThreshold;
+	releaseThreshold = cfg.releaseThreshold;
+	if(releaseThreshold > triggerThreshold){ // no hysteresis would end the run on the first sample
+		releaseThreshold = triggerThreshold;
+	}
+	releaseHoldMs = (cfg.releaseHoldMs < 0) ? 0 : cfg.releaseHoldMs;
+	peakHoldMs = (cfg.peakHoldMs < 0) ? 0 : cfg.peakHoldMs;
+	rawSectors = cfg.rawSectors;
+	flashTarget = cfg.flashTarget;
+	packBlocks = cfg.packBlocks;
+	
+	for(int i = 0; i < LOG_MAX_CHANNELS; i++){
+		deadband[i] = (mask & (1 << i)) ? cfg.deadband[i] : 0;
+	}
+	heartbeatUs = ((cfg.heartbeatMs < 1) ? 1 : cfg.heartbeatMs) * 1000LL;
+	return ESP_OK;
 }
 
-static bool stop = false;
-static long cycles = 0;
-static int delayMs = 1;
-static long bufferIndex = 0;
+int loggingGetMaxFrequency(){
+	return maxFrequency;
+}
+
+// Timing of the last run, lateness is measured from the timer alarm to the start of the sample
+static uint32_t maxLatenessUs = 0;
+static uint64_t totalLatenessUs = 0;
+static long missedSamples = 0; // alarms that fired while a previous sample was still being taken
 
-extern void loggingStart(){
-	bufferIndex = 0;
-	cycles = duration * frequency;
-	delayMs = (int) 1000.0 / frequency;
-	stop = false;
+// Allocates the capture arena and opens the log, fails if a run is already going, the arena no longer fits
+// or the log could not be opened. Sampling has started once it returns ESP_OK
+extern esp_err_t loggingArm(){
+	bool expected = false;
+	if(atomic_compare_exchange_strong(&armed, &expected, true) == false){
+		ESP_LOGE(TAG, "A run is already armed");
+		return ESP_ERR_INVALID_STATE;
+	}
+	esp_err_t err = allocateArena();
+	if(err != ESP_OK){
+		atomic_store(&armed, false);
+		return err;
+	}
+	
+	atomic_store(&stop, false);
+	atomic_store(&triggered, false);
 	xSemaphoreGive(loggingTaskBlockSemaphore);
+	xSemaphoreTake(armDone, portMAX_DELAY);
+	return armStatus;
+}
+
+// Freezes the pre trigger ring, durationSeconds more are logged before the run ends
+// The trigger engine calls this itself when the trigger channel crosses its threshold, whichever comes first wins
+extern void loggingTrigger(){
+	atomic_store(&triggered, true);
+}
+
+extern esp_err_t loggingStart(){
+	esp_err_t err = loggingArm();
+	if(err == ESP_OK){
+		loggingTrigger();
+	}
+	return err;
 }
 
 extern void loggingStop(){
-	if(cycles != 0){
-		stop = true;
+	if(atomic_load(&armed)){
+		atomic_store(&stop, true);
 	}
 }
 
-static long timestamp[30000] = {0};
-static uint16_t data[30000] = {0}; // try putting this in the psram
+// Runs in the ISR, only wakes the logging task. The timer auto reloads so the count is the time since the alarm
+static bool IRAM_ATTR loggingTimerCallback(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg){
+	BaseType_t higherPriorityTaskWoken = pdFALSE;
+	vTaskNotifyGiveFromISR(loggingTaskHandle, &higherPriorityTaskWoken);
+	return higherPriorityTaskWoken == pdTRUE;
+}
+
+// Called from the logging task so the timer interrupt is allocated on the logging core
+static void timerInit(){
+	gptimer_config_t timerConfig = {
+		.clk_src = GPTIMER_CLK_SRC_DEFAULT,
+		.direction = GPTIMER_COUNT_UP,
+		.resolution_hz = TIMER_RESOLUTION_HZ,
+	};
+	ESP_ERROR_CHECK(gptimer_new_timer(&timerConfig, &loggingTimer));
+	
+	gptimer_event_callbacks_t callbacks = {
+		.on_alarm = loggingTimerCallback,
+	};
+	ESP_ERROR_CHECK(gptimer_register_event_callbacks(loggingTimer, &callbacks, NULL));
+	ESP_ERROR_CHECK(gptimer_enable(loggingTimer));
+}
+
+static void timerStart(int frequencyHz){
+	gptimer_alarm_config_t alarmConfig = {
+		.alarm_count = TIMER_RESOLUTION_HZ / frequencyHz,
+		.reload_count = 0,
+		.flags.auto_reload_on_alarm = true,
+	};
+	ESP_ERROR_CHECK(gptimer_set_alarm_action(loggingTimer, &alarmConfig));
+	ESP_ERROR_CHECK(gptimer_set_raw_count(loggingTimer, 0));
+	ESP_ERROR_CHECK(gptimer_start(loggingTimer));
+}
+
+static void timerStop(){
+	ESP_ERROR_CHECK(gptimer_stop(loggingTimer));
+	ulTaskNotifyTake(pdTRUE, 0); // drop any alarm that fired after the last sample
+}
+
+// Layout of the armed run, fixed by the config it was armed with
+static int framesPerBlock = 1;
+static size_t recordBytes = 0;
+static size_t blockBytes = 0;
+static long ringBlocks = 0; // the pre trigger ring fills the arena
+
+static void streamReset();
+
+static esp_err_t allocateArena(){
+	size_t bytes = arenaBytes(channelCount, frequency, duration, preTriggerMs);
+	if(bytes == 0){ // no pre trigger history, the run only needs the stream ring
+		arena = NULL;
+	}else if(heap_caps_get_total_size(MALLOC_CAP_SPIRAM) != 0){
+		arena = heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	}else if(bytes <= arenaBudget()){
+		arena = heap_caps_malloc(bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+	}
+	if(arena == NULL && bytes != 0){
+		ESP_LOGE(TAG, "Capture arena of %u KB does not fit, %u KB available", (unsigned)(bytes / 1024), (unsigned)(arenaBudget() / 1024));
+		return ESP_ERR_NO_MEM;
+	}
+	
+	framesPerBlock = framesPerBlockFor(frequency);
+	recordBytes = recordBytesFor(channelCount);
+	blockBytes = blockBytesFor(channelCount, frequency);
+	ringBlocks = ringBlocksFor(frequency, preTriggerMs);
+	streamReset(); // the layout changed, consumers start over
+	return ESP_OK;
+}
+
+static void freeArena(){
+	heap_caps_free(arena);
+	arena = NULL;
+}
+
+static uint8_t *blockAt(long block){
+	return &arena[block * blockBytes];
+}
+
+static int blockFrames(uint8_t *block){
+	uint16_t frames;
+	memcpy(&frames, &block[8], sizeof(frames));
+	return frames;
+}
+
+static void blockOpen(uint8_t *block, int64_t baseUs){
+	uint16_t frames = 0;
+	memcpy(block, &baseUs, sizeof(baseUs));
+	memcpy(&block[8], &frames, sizeof(frames));
+}
+
+// Deadband channels repeat the last stored code until the sample moves past the band or the heartbeat is due
+// A held column packs down to nothing, the fast channels next to it are untouched
+static uint16_t heldCode[LOG_MAX_CHANNELS];
+static int64_t heldUs[LOG_MAX_CHANNELS];
+static bool heldValid[LOG_MAX_CHANNELS];
+
+static void deadbandReset(){
+	memset(heldValid, 0, sizeof(heldValid));
+}
+
+static uint16_t deadbandFilter(int channel, uint16_t code, int64_t timeUs){
+	if(deadband[channel] == 0){
+		return code;
+	}
+	int difference = code - heldCode[channel];
+	if(heldValid[channel] == false || difference > deadband[channel] || -difference > deadband[channel] || timeUs - heldUs[channel] >= heartbeatUs){
+		heldCode[channel] = code;
+		heldUs[channel] = timeUs;
+		heldValid[channel] = true;
+	}
+	return heldCode[channel];
+}
+
+void logRecordPack(uint8_t *record, uint16_t offsetUs, uint8_t late, const uint16_t *codes, int channels){
+	memcpy(record, &offsetUs, sizeof(offsetUs));
+	record[2] = late;
+	
+	uint8_t *packed = &record[LOG_RECORD_HEADER_BYTES];
+	for(int n = 0; n < channels; n++){
+		uint16_t code = codes[n] & 0x0FFF;
+		if(n % 2 == 0){
+			packed[0] = code >> 4;
+			packed[1] = (code & 0x0F) << 4;
+		}else{
+			packed[1] |= code >> 8;
+			packed[2] = code & 0xFF;
+			packed += 3;
+		}
+	}
+}
+
+void logRecordUnpack(const uint8_t *record, int channels, uint16_t *offsetUs, uint8_t *late, uint16_t *codes){
+	memcpy(offsetUs, record, sizeof(*offsetUs));
+	*late = record[2];
+	
+	const uint8_t *packed = &record[LOG_RECORD_HEADER_BYTES];
+	for(int n = 0; n < channels; n++){
+		if(n % 2 == 0){
+			codes[n] = (packed[0] << 4) | (packed[1] >> 4);
+		}else{
+			codes[n] = ((packed[1] & 0x0F) << 8) | packed[2];
+			packed += 3;
+		}
+	}
+}
+
+bool logReadExact(FILE *in, void *data, size_t bytes){
+	return fread(data, 1, bytes, in) == bytes;
+}
+
+// Frame holds 8 entries indexed by channel, only the enabled ones are kept
+// Samples keep their top 12 bits, the resolution of the converter
+static void blockAppend(uint8_t *block, int64_t timeUs, uint32_t late, uint16_t *frame){
+	int64_t baseUs;
+	memcpy(&baseUs, block, sizeof(baseUs));
+	int frames = blockFrames(block);
+	
+	int64_t offset = timeUs - baseUs;
+	uint16_t offsetUs = (offset > UINT16_MAX) ? UINT16_MAX : offset; // only after a long stall, already counted as missed
+	
+	uint16_t codes[LOG_MAX_CHANNELS];
+	int n = 0;
+	for(int i = 0; i < LOG_MAX_CHANNELS; i++){
+		if(sequencerMask & (1 << i)){
+			codes[n++] = deadbandFilter(i, frame[i] >> 4, timeUs);
+		}
+	}
+	logRecordPack(&block[LOG_BLOCK_HEADER_BYTES + frames * recordBytes], offsetUs, (late > UINT8_MAX) ? UINT8_MAX : late, codes, n);
+	
+	uint16_t count = frames + 1;
+	memcpy(&block[8], &count, sizeof(count));
+}
+
+// Unpacks one frame, samples are returned left justified like the adc codes
+static void blockDecode(uint8_t *block, int index, int64_t *timeUs, uint16_t *late, uint16_t *samples){
+	int64_t baseUs;
+	memcpy(&baseUs, block, sizeof(baseUs));
+	
+	uint16_t offsetUs;
+	uint8_t lateness;
+	logRecordUnpack(&block[LOG_BLOCK_HEADER_BYTES + index * recordBytes], channelCount, &offsetUs, &lateness, samples);
+	*timeUs = baseUs + offsetUs;
+	*late = lateness;
+	for(int n = 0; n < channelCount; n++){
+		samples[n] <<= 4;
+	}
+}
+
+// Hardware peaks, one row per peak hold window, channelCount values per row in channel order
+static int64_t peakTimestamp[MAX_PEAK_VALUES] = {0};
+static uint16_t peakMaximum[MAX_PEAK_VALUES] = {0};
+static uint16_t peakMinimum[MAX_PEAK_VALUES] = {0};
+static long peakIndex = 0;
+
+// Reads and resets the hardware min and max, packs the enabled channels into the next row
+static void recordPeaks(){
+	uint16_t maximum[LOG_MAX_CHANNELS] = {0};
+	uint16_t minimum[LOG_MAX_CHANNELS] = {0};
+	spiAdcReadPeaks(sequencerMask, maximum, minimum);
+	if(peakIndex == MAX_PEAK_VALUES / channelCount){
+		return; // out of rows, the rest of the run is still sampled
+	}
+	
+	peakTimestamp[peakIndex] = esp_timer_get_time();
+	uint16_t *maxRow = &peakMaximum[peakIndex * channelCount];
+	uint16_t *minRow = &peakMinimum[peakIndex * channelCount];
+	for(int i = 0; i < LOG_MAX_CHANNELS; i++){
+		if(sequencerMask & (1 << i)){
+			*maxRow++ = maximum[i];
+			*minRow++ = minimum[i];
+		}
+	}
+	peakIndex++;
+}
+
+// ================================= Stream Ring ==============================================
+// Blocks after the trigger go into a ring that every consumer reads with its own cursor
+// The capture only publishes a block count and never waits, a consumer that falls a full ring behind loses blocks
+// Consumers decode straight out of the ring and check afterwards that the block was not overwritten meanwhile
+
+static uint8_t *streamBuffer = NULL;
+static long streamSlots = 1; // blocks that fit the ring with the current layout
+static atomic_uint streamGeneration = 0; // bumped whenever the layout changes or a run starts
+static atomic_long streamHead = 0; // blocks published so far this generation
+static long streamFill = 0; // block being filled, only touched by the capture
+
+static void streamRingInit(){
+	streamBuffer = heap_caps_malloc(STREAM_RING_BYTES, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	if(streamBuffer == NULL){
+		streamBuffer = heap_caps_malloc(STREAM_RING_BYTES, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+	}
+}
+
+static uint8_t *streamAt(long block){
+	return &streamBuffer[(block % streamSlots) * blockBytes];
+}
+
+static void streamReset(){
+	streamSlots = STREAM_RING_BYTES / blockBytes;
+	if(streamSlots < 2){
+		streamSlots = 2;
+	}
+	streamFill = 0;
+	atomic_store(&streamHead, 0);
+	atomic_fetch_add(&streamGeneration, 1);
+}
+
+// Publishes the block being filled and returns the next one, may overwrite the oldest block
+static uint8_t *streamNextBlock(){
+	atomic_store_explicit(&streamHead, ++streamFill, memory_order_release);
+	xTaskNotifyGive(sdWriterTaskHandle); // never blocks
+	return streamAt(streamFill);
+}
+
+void loggingConsumerAttach(logging_consumer_t *consumer){
+	consumer->generation = atomic_load(&streamGeneration);
+	consumer->cursor = atomic_load(&streamHead);
+	consumer->overruns = 0;
+}
+
+// The next block for the consumer, NULL if there is nothing new
+static uint8_t *consumerNext(logging_consumer_t *consumer){
+	uint32_t generation = atomic_load(&streamGeneration);
+	if(generation != consumer->generation){ // a new run, start at its first block
+		consumer->generation = generation;
+		consumer->cursor = 0;
+	}
+	
+	long head = atomic_load_explicit(&streamHead, memory_order_acquire);
+	if(consumer->cursor >= head){
+		return NULL;
+	}
+	if(head - consumer->cursor >= streamSlots){ // lapped, skip to the oldest block still in the ring
+		consumer->overruns += head - consumer->cursor - (streamSlots - 1);
+		consumer->cursor = head - (streamSlots - 1);
+	}
+	return streamAt(consumer->cursor);
+}
+
+// Moves past the block from consumerNext, false if it was overwritten while it was being read
+// The capture starts writing block head after publishing it, so only a lap can have torn it
+static bool consumerDone(logging_consumer_t *consumer){
+	atomic_thread_fence(memory_order_acquire);
+	long head = atomic_load_explicit(&streamHead, memory_order_relaxed);
+	bool valid = (head - consumer->cursor < streamSlots) && (atomic_load(&streamGeneration) == consumer->generation);
+	if(valid == false){
+		consumer->overruns++;
+	}
+	consumer->cursor++;
+	return valid;
+}
+
+// Decodes the next block into the arrays, data holds loggingChannelCount values per frame
+// Returns the frames in the block, 0 if there is nothing new
+int loggingConsumerRead(logging_consumer_t *consumer, int64_t *timeUs, uint16_t *data, uint16_t *lateness){
+	uint8_t *block = consumerNext(consumer);
+	if(block == NULL){
+		return 0;
+	}
+	int frames = blockFrames(block);
+	if(frames > framesPerBlock){
+		frames = framesPerBlock;
+	}
+	for(int f = 0; f < frames; f++){
+		blockDecode(block, f, &timeUs[f], &lateness[f], &data[f * channelCount]);
+	}
+	return consumerDone(consumer) ? frames : 0;
+}
+
+int loggingChannelCount(){
+	return channelCount;
+}
+
+const char *loggingChannelName(int channel){
+	return channelNames[channel];
+}
+
+bool loggingIsArmed(){
+	return atomic_load(&armed);
+}
+
+bool loggingNeedsCard(){
+	return flashTarget == false;
+}
+
+// ================================= SD Writer ==============================================
+// Runs on core 0 as one consumer of the stream ring, copies blocks into the binary log while the capture keeps going on core 1
+// The pre trigger ring is frozen once the trigger lands, so it is read straight out of the arena
+// Blocks go to the file as they are in memory, framed with a sequence number and crc, no formatting at all
+
+static logging_consumer_t writerConsumer;
+static uint8_t writerBlock[MAX_BLOCK_BYTES]; // copy of a stream block, the ring may lap it once the copy is checked
+static uint32_t writerSequence = 0;
+static uint8_t writerPacked[MAX_BLOCK_BYTES]; // codec output, never bigger than the block
+static codec_layout_t writerLayout;
+
+// The rest of the writer does not care where the run is going
+static esp_err_t logOpen(size_t expectedBytes){
+	if(flashTarget){
+		return flashOpenLog(expectedBytes);
+	}
+	if(rawSectors){
+		return sdOpenRawLog("log", "bin", expectedBytes);
+	}
+	return sdOpenLog("log", "bin", expectedBytes);
+}
+
+static void logWrite(const void *data, size_t bytes){
+	if(flashTarget){
+		flashWriteLog(data, bytes);
+	}else{
+		sdWriteLog(data, bytes);
+	}
+}
+
+static void logSync(){
+	if(flashTarget == false){ // flash writes are already on the chip
+		sdSyncLog();
+	}
+}
+
+static void logClose(){
+	if(flashTarget){
+		flashCloseLog();
+	}else{
+		sdCloseLog();
+	}
+}
+
+static void logDiscard(){
+	if(flashTarget){
+		flashDiscardLog();
+	}else{
+		sdDiscardLog();
+	}
+}
+
+static void writeHeader(){
+	const esp_app_desc_t *app = esp_app_get_description();
+	log_file_header_t header = {
+		.magic = LOG_FILE_MAGIC,
+		.version = LOG_FORMAT_VERSION,
+		.headerBytes = sizeof(log_file_header_t),
+		.channelMask = sequencerMask,
+		.channelCount = channelCount,
+		.frequencyHz = frequency,
+		.preTriggerMs = preTriggerMs,
+		.framesPerBlock = framesPerBlock,
+		.recordBytes = recordBytes,
+		.blockBytes = sizeof(log_block_prefix_t) + blockBytes + sizeof(uint32_t)
+	};
+	// Same widths as esp_app_desc_t, copied whole so the fields stay fixed width
+	_Static_assert(sizeof(header.build) == sizeof(app->version), "build matches esp_app_desc_t");
+	_Static_assert(sizeof(header.buildDate) == sizeof(app->date), "buildDate matches esp_app_desc_t");
+	_Static_assert(sizeof(header.buildTime) == sizeof(app->time), "buildTime matches esp_app_desc_t");
+	memcpy(header.build, app->version, sizeof(header.build));
+	memcpy(header.buildDate, app->date, sizeof(header.buildDate));
+	memcpy(header.buildTime, app->time, sizeof(header.buildTime));
+	memcpy(header.averaging, averaging, sizeof(header.averaging));
+	for(int i = 0; i < LOG_MAX_CHANNELS; i++){ // no per channel calibration yet, the raw converter scale
+		header.voltsPerCode[i] = VOLTS_PER_CODE;
+		header.offsetVolts[i] = 0;
+	}
+	header.crc = esp_rom_crc32_le(0, (uint8_t *)&header, offsetof(log_file_header_t, crc));
+	logWrite(&header, sizeof(header));
+	writerSequence = 0;
+	writerLayout.channels = channelCount;
+	writerLayout.recordBytes = recordBytes;
+	writerLayout.framesPerBlock = framesPerBlock;
+}
+
+// Packing costs the writer some time on core 0, every block written after it is smaller
+static void writePacked(uint8_t *block, uint32_t sequence){
+	log_packed_prefix_t prefix = {
+		.magic = LOG_PACKED_MAGIC,
+		.sequence = sequence,
+		.bytes = codecEncodeBlock(&writerLayout, block, writerPacked)
+	};
+	uint32_t crc = esp_rom_crc32_le(0, (uint8_t *)&prefix, sizeof(prefix));
+	crc = esp_rom_crc32_le(crc, writerPacked, prefix.bytes);
+	logWrite(&prefix, sizeof(prefix));
+	logWrite(writerPacked, prefix.bytes);
+	logWrite(&crc, sizeof(crc));
+}
+
+// The summary is built from what reaches the log, blocks the writer lost are missing from it too
+static void summarizeBlock(uint8_t *block){
+	int frames = blockFrames(block);
+	for(int f = 0; f < frames; f++){
+		int64_t timeUs;
+		uint16_t late;
+		uint16_t samples[LOG_MAX_CHANNELS];
+		blockDecode(block, f, &timeUs, &late, samples);
+		summaryAddFrame(timeUs, samples);
+	}
+}
+
+static void writeBlock(uint8_t *block, uint32_t sequence){
+	summarizeBlock(block);
+	if(packBlocks){
+		writePacked(block, sequence);
+		return;
+	}
+	log_block_prefix_t prefix = {
+		.magic = LOG_BLOCK_MAGIC,
+		.sequence = sequence
+	};
+	uint32_t crc = esp_rom_crc32_le(0, (uint8_t *)&prefix, sizeof(prefix));
+	crc = esp_rom_crc32_le(crc, block, blockBytes);
+	logWrite(&prefix, sizeof(prefix));
+	logWrite(block, blockBytes);
+	logWrite(&crc, sizeof(crc));
+}
+
+static void writeBlocks(uint8_t *blocks, long count){
+	for(long b = 0; b < count; b++){
+		writeBlock(&blocks[b * blockBytes], writerSequence++);
+	}
+}
+
+// The ring in time order, oldest block first
+static void writeHistory(long armedBlocks){
+	if(armedBlocks <= ringBlocks){
+		writeBlocks(blockAt(0), armedBlocks);
+		return;
+	}
+	long oldest = armedBlocks % ringBlocks;
+	writeBlocks(blockAt(oldest), ringBlocks - oldest);
+	writeBlocks(blockAt(0), oldest);
+}
+
+// Sequence numbers follow the ring cursor, so blocks the writer lost leave a gap
+static void writeStream(){
+	uint8_t *block;
+	while((block = consumerNext(&writerConsumer)) != NULL){
+		uint32_t sequence = writerSequence + writerConsumer.cursor;
+		memcpy(writerBlock, block, blockBytes);
+		if(consumerDone(&writerConsumer)){
+			writeBlock(writerBlock, sequence);
+		}
+	}
+}
+
+static void writePeaks(){
+	if(peakIndex == 0){
+		return;
+	}
+	log_peak_prefix_t prefix = {
+		.magic = LOG_PEAK_MAGIC,
+		.windows = peakIndex,
+		.channels = channelCount
+	};
+	size_t timeBytes = peakIndex * sizeof(int64_t);
+	size_t valueBytes = peakIndex * channelCount * sizeof(uint16_t);
+	uint32_t crc = esp_rom_crc32_le(0, (uint8_t *)&prefix, sizeof(prefix));
+	crc = esp_rom_crc32_le(crc, (uint8_t *)peakTimestamp, timeBytes);
+	crc = esp_rom_crc32_le(crc, (uint8_t *)peakMaximum, valueBytes);
+	crc = esp_rom_crc32_le(crc, (uint8_t *)peakMinimum, valueBytes);
+	logWrite(&prefix, sizeof(prefix));
+	logWrite(peakTimestamp, timeBytes);
+	logWrite(peakMaximum, valueBytes);
+	logWrite(peakMinimum, valueBytes);
+	logWrite(&crc, sizeof(crc));
+}
+
+// The file is opened and preallocated when the run is armed, so the burn never waits on the fat
+static void sdWriterTask(void *arg){
+	bool open = false;
+	bool streaming = false; // the trigger has landed, the stream ring is being drained
+	int64_t lastSyncUs = 0;
+	streamMessage_t message;
+	
+	while(1){
+		ulTaskNotifyTake(pdTRUE, STREAM_POLL_MS / portTICK_PERIOD_MS);
+		
+		while(xQueueReceive(streamQueue, &message, 0) == pdTRUE){
+			switch(message.command){
+			case streamOpen:
+				streamStatus = logOpen(message.value);
+				open = (streamStatus == ESP_OK);
+				if(open){
+					writeHeader();
+					summaryBegin(channelCount, expectedFrames());
+				}
+				xSemaphoreGive(streamDone);
+				break;
+			case streamHistory:
+				writerConsumer.generation = atomic_load(&streamGeneration);
+				writerConsumer.cursor = 0; // the whole burn, not just what is new
+				writerConsumer.overruns = 0;
+				if(open){
+					writeHistory(message.value);
+				}
+				streaming = open;
+				lastSyncUs = esp_timer_get_time();
+				break;
+			case streamClose:
+				streamStatus = open ? ESP_OK : ESP_ERR_INVALID_STATE;
+				if(open){
+					writeStream(); // the capture has stopped, drain what is left
+					writePeaks();
+					summaryWrite(logWrite); // last, the tail has to end the file
+					logClose();
+					summaryEnd();
+				}
+				open = false;
+				streaming = false;
+				xSemaphoreGive(streamDone);
+				break;
+			case streamDiscard:
+				streamStatus = ESP_OK;
+				if(open){
+					logDiscard();
+					summaryEnd();
+				}
+				open = false;
+				xSemaphoreGive(streamDone);
+				break;
+			}
+		}
+		
+		if(streaming){
+			writeStream();
+			
+			// Get the data onto the card every so often, a brownout only loses the last second
+			if(esp_timer_get_time() - lastSyncUs > STREAM_SYNC_US){
+				logSync();
+				lastSyncUs = esp_timer_get_time();
+			}
+		}
+	}
+}
+
+// The capture never waits on the writer, the queue only ever holds a few messages per run
+static void streamSend(streamCommand command, long value){
+	streamMessage_t message = {
+		.command = command,
+		.value = value
+	};
+	if(xQueueSend(streamQueue, &message, 0) != pdTRUE){
+		ESP_LOGE(TAG, "SD writer queue full");
+	}
+	xTaskNotifyGive(sdWriterTaskHandle);
+}
+
+// Publishes the last block and waits for the writer to close the file, ESP_OK once a log was written and closed
+static esp_err_t streamFinish(uint8_t *block){
+	if(block != NULL && blockFrames(block) != 0){
+		atomic_store_explicit(&streamHead, ++streamFill, memory_order_release);
+	}
+	streamSend(streamClose, 0);
+	xSemaphoreTake(streamDone, portMAX_DELAY);
+	return streamStatus;
+}
+
+// The stream blocks, the pre trigger ring and a partial block at each end
+static long expectedBlocks(){
+	return ringBlocks + ((long)duration * frequency + framesPerBlock - 1) / framesPerBlock + 2;
+}
+
+static long expectedFrames(){
+	return expectedBlocks() * framesPerBlock;
+}
+
+// Everything the run can write, the blocks, the peak table and the summary
+static size_t expectedLogBytes(){
+	size_t prefixBytes = packBlocks ? sizeof(log_packed_prefix_t) : sizeof(log_block_prefix_t); // packed blocks are usually far smaller, the file is trimmed on close
+	size_t fileBlockBytes = prefixBytes + blockBytes + sizeof(uint32_t);
+	size_t bytes = sizeof(log_file_header_t) + expectedBlocks() * fileBlockBytes + summaryBytesFor(channelCount, expectedFrames());
+	if(peakHoldMs != 0){
+		long rows = MAX_PEAK_VALUES / channelCount;
+		bytes += sizeof(log_peak_prefix_t) + rows * (sizeof(int64_t) + 2 * channelCount * sizeof(uint16_t)) + sizeof(uint32_t);
+	}
+	return bytes;
+}
+
+_Static_assert(sizeof(log_catalog_record_t) == SD_CATALOG_RECORD_BYTES, "catalog records are fixed size");
+
+// Written once the file is closed, so the catalog never points at a log that is still growing
+// Flash runs keep their record in the run table, flash-log writes it to the card catalog when it copies the run over
+static void catalogRun(int64_t triggerUs, int64_t lastUs, long samples, long historyFrames, uint16_t *peaks){
+	int index = flashTarget ? 0 : sdLastLogIndex();
+	if(index < 0){
+		return;
+	}
+	log_catalog_record_t record = {
+		.magic = LOG_CATALOG_MAGIC,
+		.index = index,
+		.wallTime = time(NULL) - (esp_timer_get_time() - triggerUs) / 1000000,
+		.triggerUs = triggerUs,
+		.durationMs = (lastUs - triggerUs) / 1000 + (historyFrames * 1000) / frequency,
+		.frequencyHz = frequency,
+		.samples = samples,
+		.lostBlocks = writerConsumer.overruns,
+		.channelMask = sequencerMask
+	};
+	memcpy(record.peak, peaks, sizeof(record.peak));
+	record.crc = esp_rom_crc32_le(0, (uint8_t *)&record, offsetof(log_catalog_record_t, crc));
+	if(flashTarget){
+		flashCatalogRun(&record);
+		return;
+	}
+	sdCatalogClosedLog(index, &record);
+}
+
+// Only the block headers are read, packed blocks start with theirs unpacked
+// The trigger is not in the file, the first block time stands in for it
+esp_err_t loggingRecoverRecord(FILE *in, int index, log_catalog_record_t *record){
+	log_file_header_t header;
+	if(logReadExact(in, &header, sizeof(header)) == false || header.magic != LOG_FILE_MAGIC
+		|| esp_rom_crc32_le(0, (uint8_t *)&header, offsetof(log_file_header_t, crc)) != header.crc || header.frequencyHz == 0){
+		return ESP_ERR_INVALID_ARG;
+	}
+	size_t captureBytes = header.blockBytes - sizeof(log_block_prefix_t) - sizeof(uint32_t);
+	fseek(in, header.headerBytes, SEEK_SET);
+	
+	memset(record, 0, sizeof(log_catalog_record_t));
+	uint32_t blocks = 0;
+	uint32_t nextSequence = 0;
+	uint32_t magic;
+	while(logReadExact(in, &magic, sizeof(magic))){
+		log_packed_prefix_t prefix = {.magic = magic, .bytes = captureBytes};
+		bool read = (magic == LOG_PACKED_MAGIC) ? logReadExact(in, &prefix.sequence, sizeof(prefix) - sizeof(prefix.magic)) 
+			: (magic == LOG_BLOCK_MAGIC && logReadExact(in, &prefix.sequence, sizeof(prefix.sequence)));
+		uint8_t blockHeader[LOG_BLOCK_HEADER_BYTES];
+		if(read == false || prefix.bytes < LOG_BLOCK_HEADER_BYTES || prefix.bytes > captureBytes || logReadExact(in, blockHeader, sizeof(blockHeader)) == false
+			|| fseek(in, prefix.bytes - sizeof(blockHeader) + sizeof(uint32_t), SEEK_CUR) != 0){
+			break; // the peak table, the summary or where the last sync left off
+		}
+		int64_t timeUs;
+		uint16_t frames;
+		memcpy(&timeUs, blockHeader, sizeof(timeUs));
+		memcpy(&frames, &blockHeader[sizeof(timeUs)], sizeof(frames));
+		if(blocks++ == 0){
+			record->triggerUs = timeUs;
+		}else if(prefix.sequence > nextSequence){
+			record->lostBlocks += prefix.sequence - nextSequence;
+		}
+		nextSequence = prefix.sequence + 1;
+		record->samples += (frames > header.framesPerBlock) ? header.framesPerBlock : frames;
+	}
+	if(blocks == 0){
+		return ESP_ERR_NOT_FOUND;
+	}
+	record->magic = LOG_CATALOG_MAGIC;
+	record->index = index;
+	record->durationMs = ((uint64_t)record->samples * 1000) / header.frequencyHz;
+	record->frequencyHz = header.frequencyHz;
+	record->channelMask = header.channelMask;
+	record->flags = LOG_CATALOG_RECOVERED;
+	record->crc = esp_rom_crc32_le(0, (uint8_t *)record, offsetof(log_catalog_record_t, crc));
+	return ESP_OK;
+}
+
 //static bool bufferFilled = false;
 void loggingTask(void *arg){
-
+	timerInit();
+	
 	while(1){
 		if(xSemaphoreTake(loggingTaskBlockSemaphore, 0xffff) == pdTRUE){ 
+			// Sampling waits for the file, a trigger straight after arming would otherwise lap the stream ring while it is preallocated
+			// A run without a log is dropped here, loggingArm hands the error back so nothing gets fired
+			streamSend(streamOpen, expectedLogBytes());
+			xSemaphoreTake(streamDone, portMAX_DELAY);
+			armStatus = streamStatus;
+			if(armStatus != ESP_OK){
+				ESP_LOGE(TAG, "Log could not be opened (%s), run dropped", esp_err_to_name(armStatus));
+				freeArena();
+				atomic_store(&armed, false);
+				xSemaphoreGive(armDone);
+				continue;
+			}
 			ledsSetState(ledStatus, ledFlashing); 
+			
+			uint16_t frame[LOG_MAX_CHANNELS] = {0};
+			long bufferIndex = 0; // samples after the trigger
+			long cycles = (long)duration * frequency;
+			spiAdcBeginBatch(); // ratio and channel changes go out together
+			spiAdcSetAveraging(averaging);
+			spiAdcSetSequence(sequencerMask);
+			spiAdcCommitBatch();
+			spiAdcSessionOpen(); // the bus belongs to this run until it ends
+			
+			// Peaks are read every peakFrames samples, costs one late sample per window at high rates
+			long peakFrames = (peakHoldMs * (long)frequency) / 1000;
+			if(peakFrames < 1){
+				peakFrames = 1;
+			}
+			peakIndex = 0;
+			if(peakHoldMs != 0){
+				spiAdcSetPeakHold(true);
+			}
+			deadbandReset(); // every run starts with a stored sample on each channel
+			
+			// The arena is a ring until the trigger, the burn streams through the stream ring after it
+			uint8_t *block = NULL; // block being filled
+			long armedBlocks = 0; // ring blocks opened before the trigger
+			long armedSamples = 0;
+			long historyFrames = 0; // samples in the ring when the trigger landed
+			bool running = false; // the trigger has been seen
+			int64_t triggerUs = 0; // first and last sample after the trigger, for the catalog
+			int64_t lastUs = 0;
+			uint16_t runPeak[LOG_MAX_CHANNELS] = {0};
+			
+			// The run ends early once the trigger channel has crossed the threshold and then stayed under the release
+			long releaseFrames = ((long)releaseHoldMs * frequency) / 1000;
+			if(releaseFrames < 1){
+				releaseFrames = 1;
+			}
+			long releaseCount = 0;
+			bool crossed = false;
+			bool released = false;
+			
+			uint32_t periodUs = TIMER_RESOLUTION_HZ / frequency;
+			maxLatenessUs = 0;
+			totalLatenessUs = 0;
+			missedSamples = 0;
+			timerStart(frequency);
+			xSemaphoreGive(armDone); // sampling, the countdown can start
+			
 			while(1){
-				if(stop){
-					cycles = 0;
-					stop = false;
+				if(atomic_load(&stop)){
 					break;
 				}
-
 				
-				data[bufferIndex] = spiAdcRead(0); // swap this for the faster sequencer option
-				timestamp[bufferIndex] = esp_log_timestamp();
+				if(running == false && atomic_load(&triggered)){
+					running = true;
+					block = NULL; // the burn starts on a fresh block
+					
+					long ringFilled = (armedBlocks < ringBlocks) ? armedBlocks : ringBlocks;
+					for(long b = 0; b < ringFilled; b++){
+						historyFrames += blockFrames(blockAt(b));
+					}
+					streamSend(streamHistory, armedBlocks); // the writer can start on the history while the burn is sampled
+					if(peakHoldMs != 0){ // the peak table starts at the trigger
+						uint16_t discard[LOG_MAX_CHANNELS];
+						spiAdcReadPeaks(sequencerMask, discard, discard);
+						peakIndex = 0;
+					}
+				}
+				
+				// Block until the next alarm, more than one pending alarm means we fell behind
+				uint32_t alarms = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+				uint64_t count = 0;
+				gptimer_get_raw_count(loggingTimer, &count);
+				uint32_t late = count + (alarms - 1) * periodUs;
+				missedSamples += alarms - 1;
+				
+				int64_t timeUs = esp_timer_get_time(); // marks the start of the conversions
+				spiAdcSessionRead(frame);
+				
+				if(late > maxLatenessUs){
+					maxLatenessUs = late;
+				}
+				totalLatenessUs += late;
+				
+				uint16_t level = (triggerChannel >= 0) ? frame[triggerChannel] : 0;
+				if(triggerChannel >= 0 && level >= triggerThreshold){
+					crossed = true;
+					atomic_store(&triggered, true); // picked up before the next sample, this one is the last in the ring
+				}
+				
+				if(running == false){
+					armedSamples++;
+					if(ringBlocks == 0){ // no history wanted, wait for the trigger
+						continue;
+					}
+				}
+				if(block == NULL || blockFrames(block) == framesPerBlock){
+					if(running == false){
+						block = blockAt(armedBlocks % ringBlocks);
+						armedBlocks++;
+					}else if(block == NULL){ // first block of the burn
+						block = streamAt(streamFill);
+					}else{
+						block = streamNextBlock();
+					}
+					blockOpen(block, timeUs);
+				}
+				blockAppend(block, timeUs, late, frame);
+				
+				if(running == false){ // the ring overwrites itself until the trigger
+					continue;
+				}
 				bufferIndex++;
+				if(bufferIndex == 1){
+					triggerUs = timeUs;
+				}
+				lastUs = timeUs;
+				for(int i = 0; i < LOG_MAX_CHANNELS; i++){
+					if(frame[i] > runPeak[i]){
+						runPeak[i] = frame[i];
+					}
+				}
 				
+				if(peakHoldMs != 0 && bufferIndex % peakFrames == 0){
+					recordPeaks();
+				}
+				
+				if(crossed && level < releaseThreshold){
+					releaseCount += alarms;
+					if(releaseCount >= releaseFrames){
+						released = true;
+						break;
+					}
+				}else{
+					releaseCount = 0;
+				}
 				
-				cycles--;
+				cycles -= alarms; // missed alarms still count against the run duration
 				if(cycles <= 0){
-					cycles = 0;
 					break;
 				}
-				if(bufferIndex == 30000){
-					break;
+			}
+			
+			timerStop();
+			if(peakHoldMs != 0){
+				if(running && bufferIndex % peakFrames != 0){ // close out the last partial window
+					recordPeaks();
 				}
-
-				vTaskDelay(delayMs/ portTICK_PERIOD_MS);
+				spiAdcSetPeakHold(false);
+			}
+			spiAdcSessionClose();
+			
+			if(running == false){ // stopped while armed, nothing is written
+				ESP_LOGI(TAG, "Disarmed before the trigger, run discarded");
+				streamSend(streamDiscard, 0);
+				xSemaphoreTake(streamDone, portMAX_DELAY);
+				peakIndex = 0;
+				freeArena();
+				atomic_store(&armed, false);
+				ledsSetState(ledStatus, ledOff); 
+				continue;
+			}
+			
+			bool written = (streamFinish(block) == ESP_OK);
+			
+			if(released){
+				ESP_LOGI(TAG, "%s released after %ld samples", channelNames[triggerChannel], bufferIndex);
 			}
 			
-			sdCreateFile("log", timestamp, data, bufferIndex);
+			long samplesTaken = bufferIndex + armedSamples;
+			if(samplesTaken != 0){
+				ESP_LOGI(TAG, "%ld frames of %d channels at %d Hz, %ld before the trigger, lateness max %lu us, mean %lu us, %ld missed", 
+					bufferIndex + historyFrames, channelCount, frequency, historyFrames, maxLatenessUs, (uint32_t)(totalLatenessUs / samplesTaken), missedSamples);
+			}
+			if(writerConsumer.overruns != 0){
+				ESP_LOGW(TAG, "%ld blocks lost, the sd card fell behind", writerConsumer.overruns);
+			}
+			if(written){ // a run that never had a file would take over the record of the previous one
+				catalogRun(triggerUs, lastUs, bufferIndex + historyFrames, historyFrames, runPeak);
+			}
+
+			freeArena(); // the psram is free for the next config
+			atomic_store(&armed, false);
 			ledsSetState(ledStatus, ledOff); 
 		}
 	}
-}
\ No newline at end of file
+}
+// ================================= Console ==============================================
+// The monitor is just another consumer of the stream ring, it only shows the newest frame and never slows the capture
+
+#define MONITOR_PERIOD_MS 200
+#define LIST_CHUNK 16 // catalog records read at once
+
+static struct {
+	struct arg_int *monitor; // seconds to watch the live stream for
+	struct arg_lit *convert; // convert to volts
+    struct arg_end *end;
+} log_args;
+
+static int64_t monitorTime[BLOCK_FRAMES];
+static uint16_t monitorLateness[BLOCK_FRAMES];
+static uint16_t monitorData[BLOCK_FRAMES * LOG_MAX_CHANNELS];
+
+static void loggingMonitor(int seconds, bool convert){
+	logging_consumer_t monitor;
+	loggingConsumerAttach(&monitor);
+	
+	int64_t endUs = esp_timer_get_time() + (int64_t)seconds * 1000000;
+	while(esp_timer_get_time() < endUs){
+		vTaskDelay(MONITOR_PERIOD_MS / portTICK_PERIOD_MS);
+		
+		int frames = 0;
+		int last = 0;
+		while((last = loggingConsumerRead(&monitor, monitorTime, monitorData, monitorLateness)) != 0){
+			frames = last;
+		}
+		if(frames == 0){
+			continue; // nothing new, not triggered yet or between runs
+		}
+		
+		uint16_t *row = &monitorData[(frames - 1) * channelCount];
+		printf("%lld", monitorTime[frames - 1]);
+		for(int n = 0; n < channelCount; n++){
+			if(convert){
+				printf(", %.3f", (row[n] / 65535.0) * 5.0);
+			}else{
+				printf(", %d", row[n]);
+			}
+		}
+		printf(", overruns %ld\n", monitor.overruns);
+	}
+}
+
+static struct {
+	struct arg_int *newest; // only the last n runs
+    struct arg_end *end;
+} list_args;
+
+static log_catalog_record_t listRecords[LIST_CHUNK];
+
+static void printRecord(log_catalog_record_t *record){
+	printf("log%lu.bin %5lu.%lu s %5lu Hz %8lu samples", record->index, 
+		record->durationMs / 1000, (record->durationMs % 1000) / 100, record->frequencyHz, record->samples);
+	for(int i = 0; i < LOG_MAX_CHANNELS && (record->flags & LOG_CATALOG_RECOVERED) == 0; i++){
+		if(record->channelMask & (1 << i)){
+			printf(", %s %u", channelNames[i], record->peak[i]);
+		}
+	}
+	if(record->lostBlocks != 0){
+		printf(", %lu blocks lost", record->lostBlocks);
+	}
+	if(record->flags & LOG_CATALOG_RECOVERED){
+		printf(", recovered after a reset");
+	}
+	printf("\n");
+}
+
+// Straight out of the catalog, the log files themselves are never opened
+static int listCommand(int argc, char **argv){
+	int nerrors = arg_parse(argc, argv, (void  **) &list_args);
+	if (nerrors != 0) {
+        arg_print_errors(stderr, list_args.end, argv[0]);
+        return 1;
+    }
+	
+	int count = sdCatalogCount();
+	int first = 0;
+	if(list_args.newest->count != 0 && list_args.newest->ival[0] < count){
+		first = count - list_args.newest->ival[0];
+	}
+	if(first < 0){
+		first = 0;
+	}
+	
+	int listed = 0;
+	for(int chunk = first; chunk < count; chunk += LIST_CHUNK){
+		int read = sdCatalogRead(chunk, listRecords, LIST_CHUNK);
+		for(int r = 0; r < read; r++){
+			log_catalog_record_t *record = &listRecords[r];
+			if(record->magic != LOG_CATALOG_MAGIC || record->crc != esp_rom_crc32_le(0, (uint8_t *)record, offsetof(log_catalog_record_t, crc))){
+				continue; // a run that was discarded or never closed
+			}
+			printRecord(record);
+			listed++;
+		}
+	}
+	printf("%d runs\n", listed);
+	return 0;
+}
+
+static struct {
+	struct arg_int *channels; // sequencer mask, bit n is adc channel n
+	struct arg_int *frequency;
+	struct arg_int *duration;
+	struct arg_int *averaging; // one value for every channel or one per channel
+	struct arg_int *peakHold;
+	struct arg_int *preTrigger;
+	struct arg_int *triggerChannel;
+	struct arg_int *triggerThreshold;
+	struct arg_int *releaseThreshold;
+	struct arg_int *releaseHold;
+	struct arg_lit *raw;
+	struct arg_lit *flash;
+	struct arg_lit *pack;
+	struct arg_int *deadband; // one value for every channel or one per channel
+	struct arg_int *heartbeat;
+    struct arg_end *end;
+} config_args;
+
+// Repeated options take either one value for all the channels or one per channel in adc order
+static void perChannel(struct arg_int *arg, void (*set)(logging_config_t *cfg, int channel, int value), logging_config_t *cfg){
+	if(arg->count == 1){
+		for(int i = 0; i < LOG_MAX_CHANNELS; i++){
+			set(cfg, i, arg->ival[0]);
+		}
+		return;
+	}
+	for(int i = 0; i < arg->count; i++){
+		set(cfg, i, arg->ival[i]);
+	}
+}
+
+static void setAveraging(logging_config_t *cfg, int channel, int value){
+	cfg->averaging[channel] = value;
+}
+
+static void setDeadband(logging_config_t *cfg, int channel, int value){
+	cfg->deadband[channel] = value;
+}
+
+// Anything not given keeps its default, loggingConfig clamps and reports the rest
+static int configCommand(int argc, char **argv){
+	static const char* TAG = "log-config";
+	
+	int nerrors = arg_parse(argc, argv, (void  **) &config_args);
+	if (nerrors != 0) {
+        arg_print_errors(stderr, config_args.end, argv[0]);
+        return 1;
+    }
+	
+	logging_config_t cfg = loggingDefaultConfig();
+	if(config_args.channels->count != 0){
+		uint8_t mask = config_args.channels->ival[0];
+		cfg.loadCell1 = mask & 0x01;
+		cfg.loadCell2 = mask & 0x02;
+		cfg.loadCell3 = mask & 0x04;
+		cfg.thermistor1 = mask & 0x08;
+		cfg.thermistor2 = mask & 0x10;
+		cfg.thermistor3 = mask & 0x20;
+		cfg.pressureTransducer1 = mask & 0x40;
+		cfg.pressureTransducer2 = mask & 0x80;
+	}
+	if(config_args.frequency->count != 0){
+		cfg.frequencyHz = config_args.frequency->ival[0];
+	}
+	if(config_args.duration->count != 0){
+		cfg.durationSeconds = config_args.duration->ival[0];
+	}
+	perChannel(config_args.averaging, setAveraging, &cfg);
+	if(config_args.peakHold->count != 0){
+		cfg.peakHoldMs = config_args.peakHold->ival[0];
+	}
+	if(config_args.preTrigger->count != 0){
+		cfg.preTriggerMs = config_args.preTrigger->ival[0];
+	}
+	if(config_args.triggerChannel->count != 0){
+		cfg.triggerChannel = config_args.triggerChannel->ival[0];
+	}
+	if(config_args.triggerThreshold->count != 0){
+		cfg.triggerThreshold = config_args.triggerThreshold->ival[0];
+	}
+	if(config_args.releaseThreshold->count != 0){
+		cfg.releaseThreshold = config_args.releaseThreshold->ival[0];
+	}
+	if(config_args.releaseHold->count != 0){
+		cfg.releaseHoldMs = config_args.releaseHold->ival[0];
+	}
+	cfg.rawSectors = config_args.raw->count != 0;
+	cfg.flashTarget = config_args.flash->count != 0;
+	cfg.packBlocks = config_args.pack->count != 0;
+	perChannel(config_args.deadband, setDeadband, &cfg);
+	if(config_args.heartbeat->count != 0){
+		cfg.heartbeatMs = config_args.heartbeat->ival[0];
+	}
+	
+	if(cfg.rawSectors && cfg.flashTarget){
+		ESP_LOGE(TAG, "Pick either the raw region or flash");
+		return 1;
+	}
+	if(loggingConfig(cfg) != ESP_OK){
+		return 1;
+	}
+	ESP_LOGI(TAG, "Logging at %dHz for %ds", frequency, duration);
+	return 0;
+}
+
+static int loggingCommand(int argc, char **argv){
+	static const char* TAG = "log";
+	
+	int nerrors = arg_parse(argc, argv, (void  **) &log_args);
+	if (nerrors != 0) {
+        arg_print_errors(stderr, log_args.end, argv[0]);
+        return 1;
+    }
+	
+	if(log_args.monitor->count != 0){
+		int seconds = log_args.monitor->ival[0];
+		if(seconds < 1 || seconds > MAX_DURATION){
+			ESP_LOGE(TAG, "Invalid monitor time. Must be between 1 and %d seconds.", MAX_DURATION);
+			return 1;
+		}
+		loggingMonitor(seconds, log_args.convert->count != 0);
+	}
+	
+	return 0;
+}
+
+void loggingRegisterCommands(){
+	log_args.monitor = arg_int0("m", NULL, "<seconds>", "Print the newest frame of the running log five times a second");
+	log_args.convert = arg_lit0("f", NULL, "Display samples as volts");
+	log_args.end = arg_end(2);
+	
+	const esp_console_cmd_t cmd_log = {
+		.command = "log",
+		.help = "Watch the running log without disturbing it.",
+		.hint = NULL,
+		.func = &loggingCommand,
+		.argtable = &log_args
+	};
+	
+	list_args.newest = arg_int0("n", NULL, "<count>", "Only list the newest runs");
+	list_args.end = arg_end(2);
+	
+	const esp_console_cmd_t cmd_list = {
+		.command = "log-list",
+		.help = "List the runs on the sd card from its catalog.",
+		.hint = NULL,
+		.func = &listCommand,
+		.argtable = &list_args
+	};
+	
+	config_args.channels = arg_int0("c", "channels", "<mask>", "Channels to log, bit n is adc channel n, 1 is load cell 1");
+	config_args.frequency = arg_int0("f", "frequency", "<Hz>", "Sample rate");
+	config_args.duration = arg_int0("d", "duration", "<seconds>", "Logged after the trigger");
+	config_args.averaging = arg_intn("a", "averaging", "<samples>", 0, LOG_MAX_CHANNELS, "Averaged per conversion, 1 to 128, once for all channels or once per channel");
+	config_args.peakHold = arg_int0("k", "peak-hold", "<ms>", "Hardware min and max window, 0 disables");
+	config_args.preTrigger = arg_int0("p", "pre-trigger", "<ms>", "History kept from before the trigger");
+	config_args.triggerChannel = arg_int0("t", "trigger", "<channel>", "Adc channel the trigger watches, -1 for manual triggers only");
+	config_args.triggerThreshold = arg_int0(NULL, "trigger-code", "<code>", "Code that triggers an armed run");
+	config_args.releaseThreshold = arg_int0(NULL, "release-code", "<code>", "The run ends once the trigger channel stays below this code");
+	config_args.releaseHold = arg_int0(NULL, "release-hold", "<ms>", "How long it has to stay below the release code");
+	config_args.raw = arg_lit0("r", "raw", "Write to the raw region of the card, copied into the log file after the run");
+	config_args.flash = arg_lit0("F", "flash", "Log to the internal flash partition, copied off with flash-log");
+	config_args.pack = arg_lit0("z", "pack", "Pack blocks with the lossless codec");
+	config_args.deadband = arg_intn("b", "deadband", "<code>", 0, LOG_MAX_CHANNELS, "12 bit codes a sample has to move before it is stored, once for all channels or once per channel, needs -z");
+	config_args.heartbeat = arg_int0(NULL, "heartbeat", "<ms>", "Deadband channels are stored at least this often");
+	config_args.end = arg_end(4);
+	
+	const esp_console_cmd_t cmd_config = {
+		.command = "log-config",
+		.help = "Set up the next run, anything not given is left at its default.",
+		.hint = NULL,
+		.func = &configCommand,
+		.argtable = &config_args
+	};
+	
+	ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_log));
+	ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_list));
+	ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_config));
+}
@@ -13,6 +13,11 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_err.h"
+
+#define LOGGING_BLOCK_FRAMES 256 // most frames loggingConsumerRead returns at once
 
 typedef struct {
     bool loadCell1;
@@ -25,15 +30,149 @@ typedef struct {
 	bool pressureTransducer2;
     int frequencyHz;
 	int durationSeconds;
+	uint8_t averaging[8]; // samples averaged per conversion for each channel above, 1 to 128 in powers of 2
+	int peakHoldMs; // window the hardware min and max are read over and appended to the log, 0 disables
+	int preTriggerMs; // history kept from before loggingTrigger, durationSeconds is logged after it
+	int triggerChannel; // adc channel watched by the trigger engine, normally 0 for load cell 1, -1 for manual triggers only
+	uint16_t triggerThreshold; // code that triggers an armed run
+	uint16_t releaseThreshold; // the run ends once the channel stays below this code for releaseHoldMs
+	int releaseHoldMs;
+	bool rawSectors; // write straight to the raw region on the card, copied into the log file after the run
+	bool flashTarget; // log to the internal flash partition, no card needed, copied off with flash-log
+	bool packBlocks; // pack blocks with the lossless codec before they are written, see codec.h
+	uint16_t deadband[8]; // 12 bit codes per channel, a sample is only stored once it moves further than this from the last one, 0 stores every sample, needs packBlocks
+	int heartbeatMs; // a deadband channel is stored at least this often even when it holds still
 } logging_config_t;
 
 extern void loggingInit();
 
 extern logging_config_t loggingDefaultConfig();
-extern void loggingConfig(logging_config_t cfg);
+extern esp_err_t loggingConfig(logging_config_t cfg); // ESP_ERR_NO_MEM if the run does not fit the capture memory, ESP_ERR_INVALID_ARG for a deadband without packBlocks
+extern int loggingGetMaxFrequency(); // highest rate the configured channels and averaging can sustain
+
+// Armed runs sample into a ring until the trigger, loggingStart arms and triggers at once
+// Arming allocates the capture arena, it is freed once the log is written
+extern esp_err_t loggingArm();
+extern void loggingTrigger();
+extern esp_err_t loggingStart();
+extern void loggingStop(); // a run stopped before the trigger is discarded
+
+// Anything that wants the live samples reads the stream ring with its own cursor, the capture never waits on it
+// A consumer that falls a full ring behind skips ahead and the blocks it missed are counted in overruns
+typedef struct {
+	uint32_t generation; // run the cursor belongs to
+	long cursor; // next block to read
+	long overruns;
+} logging_consumer_t;
+
+extern void loggingConsumerAttach(logging_consumer_t *consumer); // starts at the newest block
+extern int loggingConsumerRead(logging_consumer_t *consumer, int64_t *timeUs, uint16_t *data, uint16_t *lateness); // frames read, 0 if nothing new
+extern int loggingChannelCount(); // values per frame in data, in channel order
+extern const char *loggingChannelName(int channel); // adc channel, 0 to 7
+extern bool loggingIsArmed(); // true from loggingArm until the log file is closed
+extern bool loggingNeedsCard(); // false when the run goes to internal flash
+
+extern void loggingRegisterCommands();
+
+// Binary log files, log<n>.bin, little endian
+// A header, then fixed size blocks of LOG_BLOCK_MAGIC, sequence, capture block, crc32 of everything before it in the block
+// Capture block: 64 bit time of the first frame in us, 16 bit frame count, then framesPerBlock records of recordBytes
+// Record: 16 bit us offset from the block time, 8 bit lateness in us, then the 12 bit samples of the enabled channels
+// packed two per 3 bytes in channel order, the first sample in the high bits. A block sequence gap means blocks were lost
+// With packBlocks each block is LOG_PACKED_MAGIC, sequence, packed bytes, the codec output, crc32 instead, blockBytes stays the unpacked size
+// An optional peak table follows the blocks: LOG_PEAK_MAGIC, windows, channels, 64 bit times, maxima, minima, crc32
+// The summary is last: log_summary_prefix_t, then for each level with rows, 64 bit times, minima, maxima, means, then crc32
+// Values are left justified like the peaks, one row covers factor frames from its time. The file ends with log_summary_tail_t
+// so a reader can seek straight to the summary without reading the blocks
+#define LOG_FILE_MAGIC 0x474F4C55 // "ULOG"
+#define LOG_BLOCK_MAGIC 0x4B4C4255 // "UBLK"
+#define LOG_PACKED_MAGIC 0x5A4C4255 // "UBLZ"
+#define LOG_PEAK_MAGIC 0x4B455055 // "UPEK"
+#define LOG_CATALOG_MAGIC 0x54414355 // "UCAT"
+#define LOG_CATALOG_RECOVERED 0x01 // rebuilt from the file of a run cut short, no wall time or peaks
+#define LOG_SUMMARY_MAGIC 0x4D555355 // "USUM"
+#define LOG_TAIL_MAGIC 0x4C415455 // "UTAL"
+#define LOG_SUMMARY_LEVELS 3 // 10, 100 and 1000 frames per row
+#define LOG_FORMAT_VERSION 2 // 1 had only UBLK blocks and the peak table, 2 added UBLZ packed blocks and the summary
+#define LOG_SUMMARY_VERSION 2 // first version that ends in a summary
+#define LOG_MAX_CHANNELS 8 // adc channels, the most a record holds
+#define LOG_BLOCK_HEADER_BYTES 10 // of the capture block, time and frame count
+#define LOG_RECORD_HEADER_BYTES 3 // of each record, offset and lateness
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t headerBytes; // blocks start right after the header
+	char build[32]; // firmware version, the build strings are fixed width and NUL padded, not NUL terminated when full
+	char buildDate[16]; // __DATE__ of the firmware
+	char buildTime[16]; // __TIME__ of the firmware
+	uint8_t channelMask; // bit n is adc channel n, loadCell1 is bit 0
+	uint8_t channelCount;
+	uint8_t averaging[8]; // per adc channel
+	uint32_t frequencyHz;
+	uint32_t preTriggerMs;
+	uint16_t framesPerBlock;
+	uint16_t recordBytes;
+	uint32_t blockBytes; // whole file block, magic to crc
+	float voltsPerCode[8]; // volts = code * voltsPerCode + offsetVolts, per adc channel, code is the 12 bit sample
+	float offsetVolts[8];
+	uint32_t crc; // crc32 of the header before it
+} log_file_header_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t sequence;
+} log_block_prefix_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t bytes; // codec output that follows, the whole capture block when it did not shrink
+} log_packed_prefix_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t windows;
+	uint16_t channels;
+	uint16_t reserved;
+} log_peak_prefix_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint16_t channels;
+	uint16_t levels;
+	uint32_t factor[LOG_SUMMARY_LEVELS]; // frames per row
+	uint32_t rows[LOG_SUMMARY_LEVELS]; // 0 when the level did not fit in memory
+} log_summary_prefix_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t bytes; // summary section before the tail, prefix to crc
+} log_summary_tail_t;
 
-extern void loggingStart();
-extern void loggingStop();
+// Shared by the writer and every reader of the files, codes are the 12 bit samples right justified
+// The spare nibble after the last sample of an odd channel count is zero
+extern void logRecordPack(uint8_t *record, uint16_t offsetUs, uint8_t late, const uint16_t *codes, int channels);
+extern void logRecordUnpack(const uint8_t *record, int channels, uint16_t *offsetUs, uint8_t *late, uint16_t *codes);
+extern bool logReadExact(FILE *in, void *data, size_t bytes); // false on a short read
+// One record per run in catalog.bin on the card, record n describes log<n>.bin
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t index;
+	int64_t wallTime; // seconds since 1970 at the trigger, only right once the clock has been set
+	int64_t triggerUs; // esp_timer time of the trigger
+	uint32_t durationMs; // history included
+	uint32_t frequencyHz;
+	uint32_t samples;
+	uint32_t lostBlocks;
+	uint8_t channelMask;
+	uint8_t flags; // LOG_CATALOG_RECOVERED
+	uint8_t reserved[2];
+	uint16_t peak[8]; // highest sample after the trigger per adc channel, left justified like the adc codes
+	uint32_t crc; // crc32 of the record before it
+} log_catalog_record_t;
+// Record of a run that never reached its close, from the header and block headers of its file
+extern esp_err_t loggingRecoverRecord(FILE *in, int index, log_catalog_record_t *record);
 
 
 #ifdef __cplusplus
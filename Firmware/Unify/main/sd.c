@@ -6,67 +6,249 @@
  ********************************************************************************/
  
 #include "sd.h"
+#include "logging.h" // loggingIsArmed, loggingRecoverRecord
 
 #include "pins.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-//#include <sys/unistd.h>
+#include <unistd.h> // fsync
+#include <stddef.h> // offsetof
 #include <sys/stat.h>
 
 #include "esp_vfs_fat.h"
-#include "sdmmc_cmd.h" // sdmmc print info
+#include "sdmmc_cmd.h" // sdmmc print info, raw sector access
 #include "driver/sdmmc_host.h"
+#include "diskio_sdmmc.h" // fatfs drive of the card
+#include "ff.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h" // next log index
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+
+#include "esp_console.h"
+#include "argtable3/argtable3.h" // command creation
 
 
 
 
 #define MAX_CHAR_SIZE 64
-#define MOUNT_POINT "/unify"
 
 
+#define VERIFY_BYTES (64 * 1024) // written and read back before a bus mode is trusted
+#define DEFAULT_BENCH_MB 8
+#define CATALOG_PATH SD_MOUNT_POINT "/catalog.bin"
+#define NVS_NAMESPACE "sd"
+#define NVS_NEXT_LOG "nextLog"
+#define RAW_REGION_NAME "rawlog.bin"
+#define RAW_REGION_MB 512 // reserved the first time a raw run is opened
+#define RAW_SECTOR_BYTES 512
+#define RAW_CLUSTER_SECTORS (SD_CLUSTER_BYTES / RAW_SECTOR_BYTES)
+#define RAW_SUPERBLOCK_SECTORS 6 // each of the two copies
+#define RAW_DATA_SECTOR RAW_CLUSTER_SECTORS // runs start after the superblocks, one cluster in
+#define RAW_MAGIC 0x57415255 // "URAW"
+#define RAW_RUNS 32
+#define EXPORT_PERIOD_MS 2000 // how often the exporter looks for finished raw runs
+
 static sdmmc_card_t *card;
 
 static const char *TAG = "sdcard";
 
+// Fastest first, each one is mounted and verified before it is trusted
+// No SDR50, the s3 can not switch the card lines to 1.8V
+typedef struct{
+	int freqKhz;
+	int width;
+} sd_bus_mode_t;
 
-void sdInit(){
+static const sd_bus_mode_t busModes[] = {
+	{SDMMC_FREQ_HIGHSPEED, 4},
+	{SDMMC_FREQ_DEFAULT, 4},
+	{SDMMC_FREQ_DEFAULT, 1} // still logs with a bad data line
+};
+#define BUS_MODES (sizeof(busModes) / sizeof(busModes[0]))
+
+static int busMode = -1; // index of the mode the card is mounted with
+
+static void sdExportTask(void *arg);
+static SemaphoreHandle_t rawLock = NULL; // the writer and the exporter both update the raw superblock
+
+static void busConfig(sd_bus_mode_t mode, sdmmc_host_t *host, sdmmc_slot_config_t *slot){
+	*host = (sdmmc_host_t)SDMMC_HOST_DEFAULT();
+	host->max_freq_khz = mode.freqKhz;
+	host->slot = SDMMC_HOST_SLOT_0;
+	host->flags &= ~SDMMC_HOST_FLAG_DDR; // not ddr flag
+	if(mode.width == 1){
+		host->flags &= ~(SDMMC_HOST_FLAG_4BIT | SDMMC_HOST_FLAG_8BIT);
+	}
+	
+	*slot = (sdmmc_slot_config_t)SDMMC_SLOT_CONFIG_DEFAULT();
+	slot->clk = SD_CARD_CLK_PIN;
+	slot->cmd = SD_CARD_CMD_PIN;
+	slot->d0 = SD_CARD_D0_PIN;
+	slot->d1 = SD_CARD_D1_PIN;
+	slot->d2 = SD_CARD_D2_PIN;
+	slot->d3 = SD_CARD_D3_PIN;
+	slot->width = mode.width;
+}
+
+// ESP_FAIL means the card answered but holds no filesystem, anything else is the card or the bus
+static esp_err_t mountCard(sd_bus_mode_t mode, bool format){
 	esp_vfs_fat_sdmmc_mount_config_t mount_config = {
-		.format_if_mount_failed = true,
+		.format_if_mount_failed = format,
 		.max_files = 5, // may want to increase
-		.allocation_unit_size = 16 * 1024 // check
+		.allocation_unit_size = SD_CLUSTER_BYTES
 	};
 	
-	sdmmc_host_t host = SDMMC_HOST_DEFAULT(); // should be 20MHz
-	//host.max_freq_khz = SDMMC_FREQ_HIGHSPEED; // untested
-	host.slot = SDMMC_HOST_SLOT_0;
-	//host.max_freq_khz = SDMMC_FREQ_SDR50; // untested
-	host.flags &= ~SDMMC_HOST_FLAG_DDR; // not ddr flag
-	
+	sdmmc_host_t host;
+	sdmmc_slot_config_t slot;
+	busConfig(mode, &host, &slot);
+	return esp_vfs_fat_sdmmc_mount(SD_MOUNT_POINT, &host, &slot, &mount_config, &card);
+}
+
+// A card with no filesystem can only be checked below the fat, the pattern goes in the last sectors and the format wipes it
+static esp_err_t verifySectors(sd_bus_mode_t mode){
+	sdmmc_host_t host;
+	sdmmc_slot_config_t slot;
+	busConfig(mode, &host, &slot);
+	esp_err_t err = sdmmc_host_init();
+	if(err != ESP_OK){
+		return err;
+	}
+	uint32_t *buffer = heap_caps_malloc(SD_CLUSTER_BYTES, MALLOC_CAP_DMA);
+	sdmmc_card_t probe;
+	err = sdmmc_host_init_slot(host.slot, &slot);
+	if(err == ESP_OK){
+		err = sdmmc_card_init(&host, &probe);
+	}
+	if(err == ESP_OK && buffer == NULL){
+		err = ESP_ERR_NO_MEM;
+	}
 	
-	sdmmc_slot_config_t slot = SDMMC_SLOT_CONFIG_DEFAULT();
-	slot.clk = SD_CARD_CLK_PIN;
-	slot.cmd = SD_CARD_CMD_PIN;
-	slot.d0 = SD_CARD_D0_PIN;
-	slot.d1 = SD_CARD_D1_PIN;
-	slot.d2 = SD_CARD_D2_PIN;
-	slot.d3 = SD_CARD_D3_PIN;
-	slot.width = 4;
+	size_t first = (err == ESP_OK) ? probe.csd.capacity - VERIFY_BYTES / RAW_SECTOR_BYTES : 0;
+	for(int c = 0; err == ESP_OK && c < VERIFY_BYTES / SD_CLUSTER_BYTES; c++){
+		for(int i = 0; i < SD_CLUSTER_BYTES / 4; i++){
+			buffer[i] = (c * SD_CLUSTER_BYTES / 4 + i) * 2654435761u;
+		}
+		err = sdmmc_write_sectors(&probe, buffer, first + c * RAW_CLUSTER_SECTORS, RAW_CLUSTER_SECTORS);
+	}
+	for(int c = 0; err == ESP_OK && c < VERIFY_BYTES / SD_CLUSTER_BYTES; c++){
+		err = sdmmc_read_sectors(&probe, buffer, first + c * RAW_CLUSTER_SECTORS, RAW_CLUSTER_SECTORS);
+		for(int i = 0; err == ESP_OK && i < SD_CLUSTER_BYTES / 4; i++){
+			if(buffer[i] != (c * SD_CLUSTER_BYTES / 4 + i) * 2654435761u){
+				err = ESP_ERR_INVALID_RESPONSE;
+			}
+		}
+	}
+	heap_caps_free(buffer);
+	sdmmc_host_deinit();
+	return err;
+}
+
+// Writes a pattern through the filesystem and reads it back, a marginal bus shows up as a crc error or a mismatch
+static esp_err_t verifyCard(){
+	char path[50];
+	sprintf(path, "%s/sdcheck.bin", SD_MOUNT_POINT);
+	uint32_t *buffer = malloc(SD_CLUSTER_BYTES);
+	if(buffer == NULL){
+		return ESP_ERR_NO_MEM;
+	}
 	
-	const char mount_point[] = MOUNT_POINT;
-	esp_err_t ret = esp_vfs_fat_sdmmc_mount(mount_point, &host, &slot, &mount_config, &card); 
+	esp_err_t err = ESP_OK;
+	FILE *f = fopen(path, "w");
+	if(f == NULL){
+		free(buffer);
+		return ESP_FAIL;
+	}
+	for(int c = 0; c < VERIFY_BYTES / SD_CLUSTER_BYTES; c++){
+		for(int i = 0; i < SD_CLUSTER_BYTES / 4; i++){
+			buffer[i] = (c * SD_CLUSTER_BYTES / 4 + i) * 2654435761u; // every word different
+		}
+		if(fwrite(buffer, 1, SD_CLUSTER_BYTES, f) != SD_CLUSTER_BYTES){
+			err = ESP_FAIL;
+		}
+	}
+	fclose(f);
 	
-	if(ret != ESP_OK){
-		if(ret == ESP_FAIL){
-			ESP_LOGE(TAG, "Failed to mount filesystem. " "If you want the card to be formatted, change the mount_config option to true.");
-		}else{
-			ESP_LOGE(TAG, "Failed to initialize the card (%s). " "Make sure SD card lines have pull-up resistors in place.", esp_err_to_name(ret));
+	f = fopen(path, "r");
+	if(f == NULL){
+		err = ESP_FAIL;
+	}
+	for(int c = 0; f != NULL && err == ESP_OK && c < VERIFY_BYTES / SD_CLUSTER_BYTES; c++){
+		if(fread(buffer, 1, SD_CLUSTER_BYTES, f) != SD_CLUSTER_BYTES){
+			err = ESP_FAIL;
+			break;
 		}
-		return;
+		for(int i = 0; i < SD_CLUSTER_BYTES / 4; i++){
+			if(buffer[i] != (c * SD_CLUSTER_BYTES / 4 + i) * 2654435761u){
+				err = ESP_ERR_INVALID_RESPONSE;
+				break;
+			}
+		}
+	}
+	if(f != NULL){
+		fclose(f);
+	}
+	unlink(path);
+	free(buffer);
+	return err;
+}
+
+// A blank card is formatted at the first mode whose raw read back passes, then every mode is tried again from the fastest
+// A mount that fails for any other reason can just be a bad signal, it is never a reason to format
+void sdInit(){
+	esp_err_t ret = ESP_FAIL;
+	bool formatted = false;
+	for(int i = 0; i < BUS_MODES; i++){
+		ret = mountCard(busModes[i], false);
+		if(ret == ESP_FAIL && formatted == false){
+			card = NULL;
+			esp_err_t check = verifySectors(busModes[i]);
+			if(check != ESP_OK){
+				ESP_LOGW(TAG, "No filesystem and raw read back at %d kHz %d bit failed (%s)", busModes[i].freqKhz, busModes[i].width, esp_err_to_name(check));
+				continue;
+			}
+			ESP_LOGW(TAG, "No filesystem on the card, formatting at %d kHz %d bit", busModes[i].freqKhz, busModes[i].width);
+			formatted = true;
+			ret = mountCard(busModes[i], true);
+			if(ret == ESP_OK){
+				esp_vfs_fat_sdcard_unmount(SD_MOUNT_POINT, card);
+				card = NULL;
+				i = -1; // the faster modes get another go now there is a filesystem
+				continue;
+			}
+		}
+		if(ret != ESP_OK){
+			ESP_LOGW(TAG, "Mount at %d kHz %d bit failed (%s)", busModes[i].freqKhz, busModes[i].width, esp_err_to_name(ret));
+			card = NULL;
+			continue;
+		}
+		
+		ret = verifyCard();
+		if(ret == ESP_OK){
+			busMode = i;
+			ESP_LOGI(TAG, "Card mounted at %d kHz %d bit", card->max_freq_khz, busModes[i].width);
+			rawLock = xSemaphoreCreateMutex();
+			xTaskCreatePinnedToCore(sdExportTask, "sdExportTask", 4096, NULL, 1, NULL, 0); // copies raw runs into files while idle
+			return;
+		}
+		ESP_LOGW(TAG, "Read back at %d kHz %d bit failed (%s)", busModes[i].freqKhz, busModes[i].width, esp_err_to_name(ret));
+		esp_vfs_fat_sdcard_unmount(SD_MOUNT_POINT, card);
+		card = NULL;
 	}
 	
-	//sdmmc_card_print_info(stdout, card);
+	if(ret == ESP_FAIL){
+		ESP_LOGE(TAG, "Failed to mount filesystem.");
+	}else{
+		ESP_LOGE(TAG, "Failed to initialize the card (%s). " "Make sure SD card lines have pull-up resistors in place.", esp_err_to_name(ret));
+	}
 }
 
 static esp_err_t writeFile(const char *path, char *data){
@@ -110,24 +292,616 @@ bool file_exists(char *filename){
 	return (stat (filename, &buffer) == 0);
 }
 
-// This function creates, dumps and closes a new file.
-// Increments the file name if it exists already
-void sdCreateFile(char* filename, long *timeStamp, uint16_t *data, long samples){
-	int counter = 0;
-	char filePath[50];
-	memset(filePath, 0, sizeof(filePath));
-	do{
-		sprintf(filePath, "%s/%s%d.csv", MOUNT_POINT, filename, counter);
-		counter++;
-	}while(file_exists(filePath));
+// Reserves one contiguous run of clusters up front so fatfs never has to allocate or touch the fat while writing
+// Falls back to a normal file when the card has no free run that long
+static FILE *openPreallocated(const char *path, size_t bytes, bool *preallocated){
+	*preallocated = false;
+	if(bytes != 0){
+		bytes = ((bytes + SD_CLUSTER_BYTES - 1) / SD_CLUSTER_BYTES) * SD_CLUSTER_BYTES;
+		esp_err_t err = esp_vfs_fat_create_contiguous_file(SD_MOUNT_POINT, path, bytes, true);
+		if(err == ESP_OK){
+			*preallocated = true;
+			return fopen(path, "r+"); // "w" would give the extent back
+		}
+		ESP_LOGW(TAG, "No contiguous %u KB free, %s grows as it is written (%s)", (unsigned)(bytes / 1024), path, esp_err_to_name(err));
+	}
+	return fopen(path, "w");
+}
+
+// Runs in the catalog, record n describes log n
+static long catalogRecords(){
+	struct stat info;
+	if(stat(CATALOG_PATH, &info) != 0){
+		return 0;
+	}
+	return info.st_size / SD_CATALOG_RECORD_BYTES;
+}
+
+// The next index is kept in nvs so naming a log does not mean probing the directory name by name
+// The catalog covers a card that was logged to by another stand, the probe only runs for cards from before the catalog
+static int nextLogIndex(char *filename, char *extension, char *filePath){
+	uint32_t next = 0;
+	nvs_handle_t handle;
+	bool nvsOpen = (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK);
+	if(nvsOpen){
+		nvs_get_u32(handle, NVS_NEXT_LOG, &next); // stays 0 on first boot
+	}
+	long records = catalogRecords();
+	if(records > next){
+		next = records;
+	}
 	
-	FILE *f = fopen(filePath, "w");
-	if(f == NULL){
+	sprintf(filePath, "%s/%s%lu.%s", SD_MOUNT_POINT, filename, next, extension);
+	while(file_exists(filePath)){
+		next++;
+		sprintf(filePath, "%s/%s%lu.%s", SD_MOUNT_POINT, filename, next, extension);
+	}
+	
+	// Taken as soon as it is handed out, a run that never closes does not get its name reused
+	if(nvsOpen){
+		nvs_set_u32(handle, NVS_NEXT_LOG, next + 1);
+		nvs_commit(handle);
+		nvs_close(handle);
+	}
+	return next;
+}
+
+// Creates a new file named by the next log index
+// Writes are gathered into whole clusters so the card only ever sees cluster aligned writes of a full cluster
+static FILE *logFile = NULL;
+static char logPath[50];
+static int logIndex = -1;
+static bool logPreallocated = false;
+static size_t logBytes = 0; // written so far, the preallocated file is cut back to this on close
+static WORD_ALIGNED_ATTR uint8_t clusterBuffer[SD_CLUSTER_BYTES]; // internal ram, fatfs and the raw writes hand it straight to the dma
+static size_t clusterUsed = 0;
+
+// ================================= Raw Region ==============================================
+// Raw runs skip the fat entirely, clusters go to the card with sdmmc_write_sectors
+// The region is one contiguous file, rawlog.bin, so the filesystem never hands its sectors to anything else
+// Two superblock copies at the front track the runs, the one with the higher sequence wins, the other is written next
+// After the test sdExportTask copies each finished run into log<n>.bin while nothing is being logged
+
+typedef enum{
+	rawFree, rawWriting, rawDone, rawExported
+} raw_state_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t index; // log<index>.bin once exported
+	uint32_t startSector; // from the start of the region
+	uint32_t sectors; // reserved for the run
+	uint32_t bytes; // written so far
+	uint8_t state;
+	uint8_t cataloged; // record holds the run's catalog record
+	uint8_t reserved[2];
+	uint8_t record[SD_CATALOG_RECORD_BYTES]; // written to the catalog once the run is exported
+} raw_run_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t regionSectors;
+	uint32_t nextSector; // where the next run starts
+	raw_run_t runs[RAW_RUNS];
+	uint32_t crc;
+} raw_superblock_t;
+
+_Static_assert(sizeof(raw_superblock_t) <= RAW_SUPERBLOCK_SECTORS * RAW_SECTOR_BYTES, "superblock has to fit its sectors");
+
+static size_t regionStart = 0; // card sector, 0 until the region is found
+static raw_superblock_t superblock;
+static WORD_ALIGNED_ATTR uint8_t superblockSectors[RAW_SUPERBLOCK_SECTORS * RAW_SECTOR_BYTES];
+static bool logRaw = false; // the open log is a raw run
+static int rawRun = -1; // superblock slot of the open raw run
+static int closedRawRun = -1; // slot of the raw run just closed, waiting for its catalog record
+
+static esp_err_t superblockWrite(){
+	superblock.sequence++;
+	superblock.crc = esp_rom_crc32_le(0, (uint8_t *)&superblock, offsetof(raw_superblock_t, crc));
+	memset(superblockSectors, 0, sizeof(superblockSectors));
+	memcpy(superblockSectors, &superblock, sizeof(superblock));
+	size_t copy = (superblock.sequence % 2) * RAW_SUPERBLOCK_SECTORS; // a torn write only ever hits the older copy
+	return sdmmc_write_sectors(card, superblockSectors, regionStart + copy, RAW_SUPERBLOCK_SECTORS);
+}
+
+static bool superblockRead(size_t copy, raw_superblock_t *read){
+	if(sdmmc_read_sectors(card, superblockSectors, regionStart + copy * RAW_SUPERBLOCK_SECTORS, RAW_SUPERBLOCK_SECTORS) != ESP_OK){
+		return false;
+	}
+	memcpy(read, superblockSectors, sizeof(raw_superblock_t));
+	return read->magic == RAW_MAGIC && read->crc == esp_rom_crc32_le(0, (uint8_t *)read, offsetof(raw_superblock_t, crc));
+}
+
+// Finds the region, creating it the first time, and loads the newest superblock
+static esp_err_t rawRegionInit(){
+	if(regionStart != 0){
+		return ESP_OK;
+	}
+	char path[50];
+	sprintf(path, "%s/%s", SD_MOUNT_POINT, RAW_REGION_NAME);
+	bool contiguous = false;
+	if(file_exists(path) == false){
+		ESP_LOGI(TAG, "Reserving %d MB for raw runs", RAW_REGION_MB);
+		esp_err_t err = esp_vfs_fat_create_contiguous_file(SD_MOUNT_POINT, path, (uint64_t)RAW_REGION_MB * 1024 * 1024, true);
+		if(err != ESP_OK){
+			ESP_LOGE(TAG, "No room for the raw region (%s)", esp_err_to_name(err));
+			return err;
+		}
+	}
+	if(esp_vfs_fat_test_contiguous_file(SD_MOUNT_POINT, path, &contiguous) != ESP_OK || contiguous == false){
+		ESP_LOGE(TAG, "%s is fragmented, delete it to reserve a new region", path);
+		return ESP_ERR_INVALID_STATE;
+	}
+	
+	// The first sector of the file's first cluster, fatfs sectors on the card are 512 bytes
+	char fatPath[20];
+	sprintf(fatPath, "%d:/%s", ff_diskio_get_pdrv_card(card), RAW_REGION_NAME);
+	FIL file;
+	if(f_open(&file, fatPath, FA_READ) != FR_OK){
+		return ESP_FAIL;
+	}
+	FATFS *fs = file.obj.fs;
+	size_t start = fs->database + (size_t)(file.obj.sclust - 2) * fs->csize;
+	uint32_t sectors = f_size(&file) / RAW_SECTOR_BYTES;
+	f_close(&file);
+	regionStart = start;
+	
+	raw_superblock_t copies[2];
+	bool valid[2] = {superblockRead(0, &copies[0]), superblockRead(1, &copies[1])};
+	if(valid[0] || valid[1]){
+		int newest = (valid[0] && (valid[1] == false || copies[0].sequence > copies[1].sequence)) ? 0 : 1;
+		superblock = copies[newest];
+	}else{ // a new region
+		memset(&superblock, 0, sizeof(superblock));
+		superblock.magic = RAW_MAGIC;
+		superblock.nextSector = RAW_DATA_SECTOR;
+	}
+	superblock.regionSectors = sectors;
+	return ESP_OK;
+}
+
+static bool rawOverlaps(uint32_t start, uint32_t sectors){
+	for(int r = 0; r < RAW_RUNS; r++){
+		raw_run_t *run = &superblock.runs[r];
+		if((run->state == rawWriting || run->state == rawDone) && start < run->startSector + run->sectors && run->startSector < start + sectors){
+			return true;
+		}
+	}
+	return false;
+}
+
+// Runs are laid end to end and wrap to the front once the runs there are exported
+static esp_err_t rawOpen(int index, size_t expectedBytes){
+	uint32_t sectors = ((expectedBytes + SD_CLUSTER_BYTES - 1) / SD_CLUSTER_BYTES) * RAW_CLUSTER_SECTORS;
+	uint32_t start = superblock.nextSector;
+	if(start + sectors > superblock.regionSectors){
+		start = RAW_DATA_SECTOR;
+	}
+	if(start + sectors > superblock.regionSectors || rawOverlaps(start, sectors)){
+		ESP_LOGW(TAG, "Raw region full until the finished runs are exported");
+		return ESP_ERR_NO_MEM;
+	}
+	
+	int slot = -1;
+	for(int r = 0; r < RAW_RUNS; r++){
+		if(superblock.runs[r].state == rawFree || superblock.runs[r].state == rawExported){
+			slot = r;
+			break;
+		}
+	}
+	if(slot < 0){
+		ESP_LOGW(TAG, "All %d raw runs are waiting to be exported", RAW_RUNS);
+		return ESP_ERR_NO_MEM;
+	}
+	
+	raw_run_t *run = &superblock.runs[slot];
+	run->index = index;
+	run->startSector = start;
+	run->sectors = sectors;
+	run->bytes = 0;
+	run->state = rawWriting;
+	run->cataloged = 0;
+	superblock.nextSector = start + sectors;
+	rawRun = slot;
+	return superblockWrite();
+}
+
+static void rawWriteCluster(size_t bytes){
+	raw_run_t *run = &superblock.runs[rawRun];
+	size_t sectors = (bytes + RAW_SECTOR_BYTES - 1) / RAW_SECTOR_BYTES;
+	size_t offset = run->bytes / RAW_SECTOR_BYTES; // bytes only ends off a cluster boundary after the last write
+	if(offset + sectors > run->sectors){
+		ESP_LOGE(TAG, "Raw run is past its reservation, data dropped");
+		return;
+	}
+	if(sdmmc_write_sectors(card, clusterBuffer, regionStart + run->startSector + offset, sectors) != ESP_OK){
+		ESP_LOGE(TAG, "Raw write failed");
+	}
+	run->bytes += bytes;
+}
+
+// Falls back to a file when the region can not be set up or has no room
+esp_err_t sdOpenRawLog(char *filename, char *extension, size_t expectedBytes){
+	if(card == NULL){
+		return sdOpenLog(filename, extension, expectedBytes);
+	}
+	xSemaphoreTake(rawLock, portMAX_DELAY);
+	esp_err_t err = rawRegionInit();
+	int index = -1;
+	if(err == ESP_OK){
+		memset(logPath, 0, sizeof(logPath));
+		index = nextLogIndex(filename, extension, logPath);
+		err = rawOpen(index, expectedBytes);
+	}
+	xSemaphoreGive(rawLock);
+	if(err != ESP_OK){
+		return sdOpenLog(filename, extension, expectedBytes);
+	}
+	logIndex = index;
+	logRaw = true;
+	clusterUsed = 0;
+	logBytes = 0;
+	ESP_LOGI(TAG, "Logging raw to sector %u, exported to %s later", (unsigned)(regionStart + superblock.runs[rawRun].startSector), logPath);
+	return ESP_OK;
+}
+
+esp_err_t sdOpenLog(char *filename, char *extension, size_t expectedBytes){
+	memset(logPath, 0, sizeof(logPath));
+	logIndex = nextLogIndex(filename, extension, logPath);
+	
+	logFile = openPreallocated(logPath, expectedBytes, &logPreallocated);
+	if(logFile == NULL){
 		ESP_LOGE(TAG, "Failed to open file for writing");
+		logIndex = -1; // nothing to catalog
+		return ESP_FAIL;
+	}
+	setvbuf(logFile, NULL, _IONBF, 0); // clusters go straight to fatfs without another copy
+	clusterUsed = 0;
+	logBytes = 0;
+	ESP_LOGI(TAG, "Logging to %s", logPath);
+	return ESP_OK;
+}
+
+void sdWriteLog(const void *data, size_t bytes){
+	if(logFile == NULL && logRaw == false){
 		return;
 	}
-	for(int i = 0; i < samples; i++){
-		fprintf(f, "%ld, %d\n", timeStamp[i], data[i]);
+	const uint8_t *next = data;
+	while(bytes != 0){
+		size_t chunk = SD_CLUSTER_BYTES - clusterUsed;
+		if(chunk > bytes){
+			chunk = bytes;
+		}
+		memcpy(&clusterBuffer[clusterUsed], next, chunk);
+		clusterUsed += chunk;
+		logBytes += chunk;
+		next += chunk;
+		bytes -= chunk;
+		
+		if(clusterUsed == SD_CLUSTER_BYTES && logRaw){
+			rawWriteCluster(SD_CLUSTER_BYTES);
+			clusterUsed = 0;
+		}else if(clusterUsed == SD_CLUSTER_BYTES){
+			if(fwrite(clusterBuffer, 1, SD_CLUSTER_BYTES, logFile) != SD_CLUSTER_BYTES){
+				ESP_LOGE(TAG, "Log write failed");
+			}
+			clusterUsed = 0;
+		}
+	}
+}
+
+// Only whole clusters are on the card, the partial one waits so later writes stay aligned
+// A raw run only has to record how far it got, the data is already on the card
+void sdSyncLog(){
+	if(logRaw){
+		xSemaphoreTake(rawLock, portMAX_DELAY);
+		superblockWrite();
+		xSemaphoreGive(rawLock);
+		return;
+	}
+	if(logFile == NULL){
+		return;
+	}
+	fsync(fileno(logFile));
+}
+
+void sdCloseLog(){
+	if(logRaw){
+		if(clusterUsed != 0){
+			memset(&clusterBuffer[clusterUsed], 0, SD_CLUSTER_BYTES - clusterUsed); // pads the last sector
+			rawWriteCluster(clusterUsed);
+			clusterUsed = 0;
+		}
+		xSemaphoreTake(rawLock, portMAX_DELAY);
+		superblock.runs[rawRun].state = rawDone;
+		superblockWrite();
+		xSemaphoreGive(rawLock);
+		closedRawRun = rawRun;
+		logRaw = false;
+		return;
+	}
+	if(logFile == NULL){
+		return;
+	}
+	if(clusterUsed != 0){
+		fwrite(clusterBuffer, 1, clusterUsed, logFile);
+		clusterUsed = 0;
+	}
+	if(logPreallocated){
+		ftruncate(fileno(logFile), logBytes); // gives back the part of the extent the run did not use
+	}
+	fclose(logFile);
+	logFile = NULL;
+}
+
+int sdLastLogIndex(){
+	return logIndex;
+}
+
+// Record index sits at index * SD_CATALOG_RECORD_BYTES, so writing and finding a run never scans anything
+esp_err_t sdCatalogWrite(int index, const void *record){
+	FILE *f = fopen(CATALOG_PATH, "r+");
+	if(f == NULL){
+		f = fopen(CATALOG_PATH, "w+");
+	}
+	if(f == NULL){
+		ESP_LOGE(TAG, "Failed to open the catalog");
+		return ESP_FAIL;
+	}
+	esp_err_t err = ESP_OK;
+	if(fseek(f, (long)index * SD_CATALOG_RECORD_BYTES, SEEK_SET) != 0 || fwrite(record, 1, SD_CATALOG_RECORD_BYTES, f) != SD_CATALOG_RECORD_BYTES){
+		ESP_LOGE(TAG, "Catalog write failed");
+		err = ESP_FAIL;
+	}
+	fclose(f);
+	return err;
+}
+
+// The file of a raw run only exists once it is exported, the record waits in the superblock until then
+esp_err_t sdCatalogClosedLog(int index, const void *record){
+	if(closedRawRun < 0){
+		return sdCatalogWrite(index, record);
+	}
+	xSemaphoreTake(rawLock, portMAX_DELAY);
+	raw_run_t *run = &superblock.runs[closedRawRun];
+	memcpy(run->record, record, SD_CATALOG_RECORD_BYTES);
+	run->cataloged = 1;
+	esp_err_t err = superblockWrite();
+	xSemaphoreGive(rawLock);
+	closedRawRun = -1;
+	return err;
+}
+
+// Records read, a run that never closed leaves a hole the caller has to skip
+int sdCatalogRead(int first, void *records, int count){
+	FILE *f = fopen(CATALOG_PATH, "r");
+	if(f == NULL){
+		return 0;
+	}
+	int read = 0;
+	if(fseek(f, (long)first * SD_CATALOG_RECORD_BYTES, SEEK_SET) == 0){
+		read = fread(records, SD_CATALOG_RECORD_BYTES, count, f);
 	}
 	fclose(f);
-}
\ No newline at end of file
+	return read;
+}
+
+int sdCatalogCount(){
+	return catalogRecords();
+}
+
+void sdDiscardLog(){
+	if(logRaw){
+		xSemaphoreTake(rawLock, portMAX_DELAY);
+		superblock.runs[rawRun].state = rawFree;
+		superblock.nextSector = superblock.runs[rawRun].startSector; // nothing worth keeping, the space is reused
+		superblockWrite();
+		xSemaphoreGive(rawLock);
+		closedRawRun = -1;
+		logRaw = false;
+		logIndex = -1;
+		return;
+	}
+	logIndex = -1; // the index is free for the next run, its catalog record is never written
+	if(logFile == NULL){
+		return;
+	}
+	fclose(logFile);
+	logFile = NULL;
+	unlink(logPath);
+}
+
+// Copies one finished run into its file, gives up as soon as a log is opened and starts over next time
+static void exportRun(raw_run_t *run, uint8_t *buffer){
+	char path[50];
+	sprintf(path, "%s/log%lu.bin", SD_MOUNT_POINT, run->index);
+	FILE *f = fopen(path, "w");
+	if(f == NULL){
+		return;
+	}
+	setvbuf(f, NULL, _IONBF, 0);
+	
+	uint32_t copied = 0;
+	while(copied < run->bytes){
+		if(logFile != NULL || logRaw){ // the card belongs to the logger
+			fclose(f);
+			unlink(path);
+			return;
+		}
+		uint32_t chunk = run->bytes - copied;
+		if(chunk > SD_CLUSTER_BYTES){
+			chunk = SD_CLUSTER_BYTES;
+		}
+		size_t sectors = (chunk + RAW_SECTOR_BYTES - 1) / RAW_SECTOR_BYTES;
+		if(sdmmc_read_sectors(card, buffer, regionStart + run->startSector + copied / RAW_SECTOR_BYTES, sectors) != ESP_OK 
+			|| fwrite(buffer, 1, chunk, f) != chunk){
+			ESP_LOGE(TAG, "Export of raw run %lu failed", run->index);
+			fclose(f);
+			unlink(path);
+			return;
+		}
+		copied += chunk;
+	}
+	fclose(f);
+	
+	// Cataloged only now the file is complete, a run cut short by a reset gets a record rebuilt from its file
+	log_catalog_record_t record;
+	bool cataloged = run->cataloged;
+	if(cataloged){
+		memcpy(&record, run->record, sizeof(record));
+	}else if((f = fopen(path, "r")) != NULL){
+		cataloged = (loggingRecoverRecord(f, run->index, &record) == ESP_OK);
+		fclose(f);
+	}
+	if(cataloged){
+		sdCatalogWrite(run->index, &record);
+	}
+	
+	xSemaphoreTake(rawLock, portMAX_DELAY);
+	run->state = rawExported;
+	superblockWrite();
+	xSemaphoreGive(rawLock);
+	ESP_LOGI(TAG, "Raw run exported to %s", path);
+}
+
+// Lowest priority, only runs while nothing is being logged
+// A run still marked writing after a reboot is exported up to its last sync
+// Armed covers the gap between closing a run and handing over its catalog record
+static void sdExportTask(void *arg){
+	uint8_t *buffer = heap_caps_malloc(SD_CLUSTER_BYTES, MALLOC_CAP_DMA);
+	while(1){
+		vTaskDelay(EXPORT_PERIOD_MS / portTICK_PERIOD_MS);
+		if(buffer == NULL || logFile != NULL || logRaw || loggingIsArmed()){
+			continue;
+		}
+		char path[50];
+		sprintf(path, "%s/%s", SD_MOUNT_POINT, RAW_REGION_NAME);
+		if(regionStart == 0 && file_exists(path) == false){
+			continue; // raw logging has never been used on this card
+		}
+		xSemaphoreTake(rawLock, portMAX_DELAY);
+		raw_run_t *run = NULL;
+		if(rawRegionInit() == ESP_OK){
+			for(int r = 0; r < RAW_RUNS; r++){
+				if(superblock.runs[r].state == rawDone || superblock.runs[r].state == rawWriting){
+					run = &superblock.runs[r];
+					break; // one per pass, the logger may want the card back
+				}
+			}
+		}
+		xSemaphoreGive(rawLock);
+		if(run != NULL){
+			exportRun(run, buffer);
+		}
+	}
+}
+
+// Stuff for the console
+static struct {
+	struct arg_int *bench; // megabytes to write
+	struct arg_lit *preallocate; // compare against a preallocated file
+	struct arg_lit *info; // card details
+    struct arg_end *end;
+} sd_args;
+
+static int compareLatency(const void *a, const void *b){
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Cluster sized writes like the logger, timed one by one so the stalls show up
+static void sdBenchmark(int megabytes, bool preallocate){
+	char path[50];
+	sprintf(path, "%s/sdbench.bin", SD_MOUNT_POINT);
+	long writes = (megabytes * 1024L * 1024L) / SD_CLUSTER_BYTES;
+	uint32_t *latency = malloc(writes * sizeof(uint32_t));
+	uint8_t *buffer = heap_caps_malloc(SD_CLUSTER_BYTES, MALLOC_CAP_DMA);
+	bool preallocated = false;
+	int64_t openUs = esp_timer_get_time();
+	FILE *f = preallocate ? openPreallocated(path, writes * SD_CLUSTER_BYTES, &preallocated) : fopen(path, "w");
+	openUs = esp_timer_get_time() - openUs;
+	if(latency == NULL || buffer == NULL || f == NULL){
+		ESP_LOGE(TAG, "Benchmark setup failed");
+		free(latency);
+		heap_caps_free(buffer);
+		if(f != NULL){
+			fclose(f);
+		}
+		return;
+	}
+	setvbuf(f, NULL, _IONBF, 0);
+	memset(buffer, 0xA5, SD_CLUSTER_BYTES);
+	
+	int64_t startUs = esp_timer_get_time();
+	for(long i = 0; i < writes; i++){
+		int64_t writeUs = esp_timer_get_time();
+		fwrite(buffer, 1, SD_CLUSTER_BYTES, f);
+		latency[i] = esp_timer_get_time() - writeUs;
+	}
+	fsync(fileno(f));
+	fclose(f);
+	int64_t totalUs = esp_timer_get_time() - startUs;
+	unlink(path);
+	
+	qsort(latency, writes, sizeof(uint32_t), compareLatency);
+	printf("%s: %d MB at %d kHz %d bit, %.2f MB/s, open %lld ms\n", preallocated ? "Preallocated" : "Growing", 
+		megabytes, card->max_freq_khz, busModes[busMode].width, megabytes / (totalUs / 1000000.0), openUs / 1000);
+	printf("%d KB write latency us: p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu\n", SD_CLUSTER_BYTES / 1024,
+		latency[(writes - 1) * 500 / 1000], latency[(writes - 1) * 900 / 1000], latency[(writes - 1) * 990 / 1000], latency[(writes - 1) * 999 / 1000], latency[writes - 1]);
+	
+	free(latency);
+	heap_caps_free(buffer);
+}
+
+static int sdBenchCommand(int argc, char **argv){
+	int nerrors = arg_parse(argc, argv, (void  **) &sd_args);
+	if (nerrors != 0) {
+        arg_print_errors(stderr, sd_args.end, argv[0]);
+        return 1;
+    }
+	if(card == NULL){
+		ESP_LOGE(TAG, "No card mounted");
+		return 1;
+	}
+	if(logFile != NULL || logRaw || loggingIsArmed()){ // raw runs have no file, an armed run is about to open one
+		ESP_LOGE(TAG, "A log is being written");
+		return 1;
+	}
+	
+	if(sd_args.info->count != 0){
+		sdmmc_card_print_info(stdout, card);
+		return 0;
+	}
+	
+	int megabytes = DEFAULT_BENCH_MB;
+	if(sd_args.bench->count != 0){
+		megabytes = sd_args.bench->ival[0];
+	}
+	if(megabytes < 1 || megabytes > 1024){
+		ESP_LOGE(TAG, "Invalid size. Must be between 1 and 1024 MB.");
+		return 1;
+	}
+	sdBenchmark(megabytes, false);
+	if(sd_args.preallocate->count != 0){
+		sdBenchmark(megabytes, true);
+	}
+	return 0;
+}
+
+void sdRegisterCommands(){
+	sd_args.bench = arg_int0("s", NULL, "<MB>", "Megabytes to write, 8 by default");
+	sd_args.preallocate = arg_lit0("p", NULL, "Run again with the file preallocated and compare");
+	sd_args.info = arg_lit0("i", NULL, "Print the card details instead");
+	sd_args.end = arg_end(2);
+	
+	const esp_console_cmd_t cmd_bench = {
+		.command = "sd-bench",
+		.help = "Sequential write speed and write latency of the sd card.",
+		.hint = NULL,
+		.func = &sdBenchCommand,
+		.argtable = &sd_args
+	};
+	
+	ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_bench));
+}
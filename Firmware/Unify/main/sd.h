@@ -21,10 +21,32 @@ extern "C" {
 #endif
 
 #include "stdint.h"
+#include <stddef.h>
+#include "esp_err.h"
 
-extern void sdInit();
+extern void sdInit(); // mounts at the fastest bus mode that passes a read back
+extern void sdRegisterCommands();
 
-extern void sdCreateFile(char *filename, long *timeStamp, uint16_t *data, long samples);
+#define SD_MOUNT_POINT "/unify"
+#define SD_CLUSTER_BYTES (16 * 1024) // allocation unit the card is formatted with
+
+// One log file open at a time, named filename<n>.extension with the first free n
+// expectedBytes are preallocated as one contiguous extent, 0 lets the file grow as it is written
+extern esp_err_t sdOpenLog(char *filename, char *extension, size_t expectedBytes);
+// Same log written straight to the raw region on the card, bypassing the fat, and exported to the file after the run
+extern esp_err_t sdOpenRawLog(char *filename, char *extension, size_t expectedBytes);
+extern void sdWriteLog(const void *data, size_t bytes); // buffered and written a whole cluster at a time
+extern void sdSyncLog(); // pushes the whole clusters written so far onto the card
+extern void sdCloseLog(); // writes the last partial cluster, trims what was preallocated and not used
+extern void sdDiscardLog(); // closes and deletes the log
+extern int sdLastLogIndex(); // n of the last log opened, -1 if none
+
+// Catalog of runs on the card, one fixed size record per log index
+#define SD_CATALOG_RECORD_BYTES 64
+extern esp_err_t sdCatalogWrite(int index, const void *record);
+extern esp_err_t sdCatalogClosedLog(int index, const void *record); // a raw run keeps its record until it is exported
+extern int sdCatalogRead(int first, void *records, int count); // records read
+extern int sdCatalogCount(); // records in the catalog, including holes
 
 #ifdef __cplusplus
 }
@@ -8,6 +8,7 @@
 #include "spi.h"
 
 #include <string.h> //memset
+#include <stdlib.h> //malloc
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -15,6 +16,9 @@
 #include "esp_log.h"
 #include "esp_console.h"
 #include "argtable3/argtable3.h" // command creation
+#include "esp_timer.h" // benchmark timing
+#include "esp_heap_caps.h" // dma capable buffers
+#include "esp_rom_sys.h" // esp_rom_delay_us
 
 #include "hal/spi_types.h"
 #include "driver/spi_common.h"
@@ -24,8 +28,95 @@
 #define MAX_DEVICES 1
 #define ADC_DEVICE_NUMBER 0
 
+// Queued dma reads, every conversion needs its own CS edge so a batch is a queue of single frames
+// Frames stay 24 clocks, longer ones change how the ADS7028 takes OSR writes and on the fly channel commands
+// Each frame gets a word aligned slot of the dma capable buffers, only the first 3 bytes are shifted
+#define ADC_QUEUE_SIZE 24 // one full round of the longest sequence
+#define ADC_FRAME_BYTES 3
+#define ADC_DMA_SLOT_BYTES 4
+
+// ADS7028 SPI Commands
+#define ADC_CMD_READ                                0x10
+#define ADC_CMD_WRITE                               0x08
+#define ADC_CMD_SET_BIT                             0x18
+#define ADC_CMD_CLEAR_BIT                           0x20
+
+// ADS7028 Register Addresses
+#define ADC_SYSTEM_STATUS_REG_ADDR                  0x00
+#define ADC_GENERAL_CFG_REG_ADDR                    0x01
+#define ADC_DATA_CFG_REG_ADDR                       0x02
+#define ADC_OSR_CFG_REG_ADDR                        0x03
+#define ADC_OPMODE_CFG_REG_ADDR                     0x04
+#define ADC_PIN_CFG_REG_ADDR                        0x05
+#define ADC_GPI_VALUE_REG_ADDR                      0x0D
+#define ADC_SEQUENCE_CFG_REG_ADDR                   0x10
+#define ADC_CHANNEL_SEL_REG_ADDR                    0x11
+#define ADC_AUTO_SEQ_CH_SEL_REG_ADDR                0x12
+#define ADC_EVENT_FLAG_REG_ADDR                     0x18
+#define ADC_EVENT_HIGH_FLAG_REG_ADDR                0x1A
+#define ADC_EVENT_LOW_FLAG_REG_ADDR                 0x1C
+#define ADC_MAX_CH0_LSB_REG_ADDR                    0x60 // LSB then MSB for each channel
+#define ADC_MIN_CH0_LSB_REG_ADDR                    0x80
+
+#define ADC_GENERAL_CFG_STATS_EN_BIT 5 // writing a 1 also clears the min and max registers
+#define ADC_MAX_REGISTER_READS 32 // min and max of all 8 channels
+
+// Shadow copy of the configuration and threshold registers, everything above is read only data
+#define ADC_SHADOW_SIZE 0x40
+#define ADC_GENERAL_CFG_SELF_CLEARING 0x0B // RST, CAL and CNVST read back as 0 once they are done
+#define ADC_MAX_STAGED_FRAMES 16
+
+// Timing used to space out frames, the internal oscillator runs one conversion per us
+#define ADC_CONVERSION_US 1 // per averaged sample
+#define ADC_FRAME_US 2 // 24 clocks at 20MHz plus CS setup, the wire time only, the floor of the measured frame cost
+#define ADC_CALIBRATION_ROUNDS 200 // session rounds timed per mask in calibrateSequenceRate
+#define ADC_QUEUED_GAP_US 10 // driver turnaround between queued transactions, covers 8x averaging
+#define ADC_MAX_ROUND_FRAMES 24 // 8 channels plus an OSR write and a flush frame per averaging group
+
 // Used to track the mode of the adc
-static bool sequencerMode = 0; // adc starts in manual mode
+typedef enum{
+	adcManualMode, adcAutoSequenceMode, adcOnTheFlyMode
+} adcModeType;
+static adcModeType adcMode = adcManualMode; // adc starts in manual mode
+static spiAdcSequenceType sequenceType = spiAdcAutoSequence; // mode used by spiAdcSetSequence
+static uint8_t sequenceMask = 0; // channels enabled in the sequence
+static int sequenceLength = 0; // number of channels in the sequence
+static uint8_t sequenceChannels[8] = {0}; // enabled channels in order, used by on the fly mode
+static uint8_t sequenceIndex[8] = {0}; // position of each channel within a round of the sequence
+static uint8_t channelAveraging[8] = {8, 8, 8, 8, 8, 8, 8, 8}; // samples averaged per conversion, per channel
+
+// One round of the sequence, built when the sequence is set so reads only shift frames
+typedef struct{
+	uint8_t tx[3]; // on the fly channel select or an OSR write
+	int8_t channel; // channel of the result shifted in, -1 if it is thrown away
+	bool averaged; // the result shifted in was averaged, changes the data format
+	uint16_t waitUs; // conversion time of the previous frame, waited before this frame starts
+} adcFrameType;
+static adcFrameType roundFrames[ADC_MAX_ROUND_FRAMES];
+static int roundLength = 0;
+static int32_t frameCostNs = ADC_FRAME_US * 1000; // per frame of a session round, driver and CS overhead included, measured at init
+static int32_t roundCostNs = 0; // per session round on top of its frames, the decode and the loop
+static bool roundQueueable = true; // every conversion fits in the gap between queued frames
+
+// Descriptors and dma buffers for the queued path, one slot per queue entry
+static spi_transaction_t queuedTransactions[ADC_QUEUE_SIZE];
+static uint8_t *queuedTx = NULL;
+static uint8_t *queuedRx = NULL;
+
+static bool sessionOpen = false; // the logging session owns the bus and the queued descriptors
+static TaskHandle_t sessionOwner = NULL; // only this task may use the bus while the session is open
+
+// Register writes are checked against the shadow and staged, then sent back to back in one burst
+static uint8_t shadowRegisters[ADC_SHADOW_SIZE] = {0};
+static bool shadowValid[ADC_SHADOW_SIZE] = {0}; // filled lazily from the device on first use
+static uint8_t stagedFrames[ADC_MAX_STAGED_FRAMES * 3] = {0};
+static int stagedCount = 0;
+static int batchDepth = 0; // writes are only committed once every open batch is closed, the bus is held until then
+
+// spiSemaphore is reentrant for the task holding it, batches and sessions keep the bus and the adc state
+// from their first call to their last, so nothing else can change the sequence or stage frames in between
+static TaskHandle_t busOwner = NULL;
+static int busDepth = 0;
 
 // Store the device handles, overbuilt for this application
 static spi_device_handle_t deviceHandles[MAX_DEVICES] = {0}; 
@@ -44,14 +135,34 @@ static void removeDevice(int deviceNumber);
 // Thread safe generic i2c interface
 void genericTransmit(int deviceNumber, uint8_t *data, uint8_t len);
 void genericRecieve(int deviceNumber, uint8_t *data, uint8_t len);
+static void genericRecieveFrames(int deviceNumber, uint8_t *data, uint8_t len, int frames);
+static void genericTransmitFrames(int deviceNumber, uint8_t *data, uint8_t len, int frames);
+static void genericTransferFrames(int deviceNumber, uint8_t *txData, uint8_t *rxData, uint8_t len, int frames);
+static bool lockBus();
+static bool lockBusWait(TickType_t ticks);
+static void unlockBus();
+static void genericQueueFrame(int deviceNumber, int slot);
+static void genericCollectFrame(int deviceNumber);
 
 // Basic adc interface
 static void adcInit();
 static void adcWriteRegister(uint8_t address, uint8_t data);
 static uint8_t adcReadRegister(uint8_t address);
+static void adcReadRegisters(const uint8_t *addresses, uint8_t *values, int count);
+static uint8_t adcGetRegister(uint8_t address); // cached
+static void adcStageFrame(uint8_t command, uint8_t address, uint8_t data);
+static void adcBeginBatch();
+static void adcCommitBatch();
+static void adcFlushStaged();
+static void adcInvalidateShadow();
+static void fillQueuedFrame(int slot, long frame);
 static void adcWriteBit(uint8_t address, uint8_t bit, bool value);
 static bool adcReadBit(uint8_t address, uint8_t bit);
 static uint16_t adcMeasureChannel(int channel); // 12 bit data, left padded 0s
+static uint16_t adcDecodeFrame(uint8_t *rxBuffer, bool averaged, uint8_t *channel);
+static uint8_t averagingCode(uint8_t averaging);
+static uint8_t onTheFlyCommand(uint8_t channel);
+static void calibrateSequenceRate();
 
 
 extern void spiInit(gpio_num_t misoPin, gpio_num_t mosiPin, gpio_num_t clkPin, gpio_num_t csPin){
@@ -61,13 +172,25 @@ extern void spiInit(gpio_num_t misoPin, gpio_num_t mosiPin, gpio_num_t clkPin, g
 	initBus(misoPin, mosiPin, clkPin);
 	addDevice(csPin, SPI_MASTER_FREQ_20M, 0, ADC_DEVICE_NUMBER);
 	
+	queuedTx = heap_caps_calloc(ADC_QUEUE_SIZE, ADC_DMA_SLOT_BYTES, MALLOC_CAP_DMA);
+	queuedRx = heap_caps_calloc(ADC_QUEUE_SIZE, ADC_DMA_SLOT_BYTES, MALLOC_CAP_DMA);
+	memset(queuedTransactions, 0, sizeof(queuedTransactions));
+	for(int i = 0; i < ADC_QUEUE_SIZE; i++){
+		queuedTransactions[i].length = 8 * ADC_FRAME_BYTES;
+		queuedTransactions[i].tx_buffer = &queuedTx[i * ADC_DMA_SLOT_BYTES];
+		queuedTransactions[i].rx_buffer = &queuedRx[i * ADC_DMA_SLOT_BYTES];
+	}
+	
 	vTaskDelay(100 / portTICK_PERIOD_MS); // testing
 	adcInit();
+	calibrateSequenceRate();
 }
 
 extern void spiDeinit(){
 	removeDevice(ADC_DEVICE_NUMBER);
 	deinitBus();
+	heap_caps_free(queuedTx);
+	heap_caps_free(queuedRx);
 }
 
 uint16_t spiAdcRead(int channel){
@@ -84,6 +207,7 @@ static struct {
 	struct arg_int *address; // read/write from register at address
     struct arg_int *write; // value to write
 	struct arg_lit *read; // read from address
+	struct arg_lit *cached; // read the shadow copy instead of the device
 	struct arg_int *bit; // sepcify bit position fro read/write
     struct arg_end *end;
 } spi_reg_args;
@@ -96,6 +220,10 @@ static int spiRegDevCommand(int argc, char **argv){
         arg_print_errors(stderr, spi_reg_args.end, argv[0]);
         return 1;
     }
+	if(sessionOpen){ // would wait on the bus until the run is over
+		ESP_LOGE(TAG, "The adc is being sampled by a run.");
+		return 1;
+	}
 	int address = spi_reg_args.address->ival[0];
 	
 	if(spi_reg_args.write->count != 0){ // Write to the device
@@ -129,16 +257,199 @@ static int spiRegDevCommand(int argc, char **argv){
 		}
 	}
 	
+	if(spi_reg_args.cached->count != 0){ // Query the shadow, only touches the device if the register was never used
+		printf("0x%02x\n", adcGetRegister(address));
+	}
+	
 	return 0;
 }
 
 static struct {
 	struct arg_int *measure; // Read a single channel
     struct arg_int *sequence; // Run Sequencer over masked channels
+	struct arg_lit *onTheFly; // Use on the fly channel selection for the sequence
+	struct arg_int *benchmark; // Compare read modes over masked channels
+	struct arg_int *cpuBenchmark; // Compare cpu use of polling and dma reads over masked channels
+	struct arg_int *latency; // Per sample latency of a session over masked channels
+	struct arg_int *peaks; // Hold the min and max of masked channels
 	struct arg_lit *convert; // Convert to floats
     struct arg_end *end;
 } spi_adc_args;
 
+#define BENCHMARK_SAMPLES 10000
+
+// Prints samples per second for manual, auto sequence and on the fly reads over the channels in the mask
+static void spiAdcBenchmark(uint8_t channelMask){
+	int channels[8];
+	int count = 0;
+	for(int i = 0; i < 8; i++){
+		if(channelMask & (1 << i)){
+			channels[count++] = i;
+		}
+	}
+	int rounds = BENCHMARK_SAMPLES / count;
+	uint16_t data[8] = {0};
+	
+	int64_t start = esp_timer_get_time();
+	for(int i = 0; i < rounds; i++){
+		for(int j = 0; j < count; j++){
+			data[channels[j]] = adcMeasureChannel(channels[j]);
+		}
+	}
+	int64_t manualUs = esp_timer_get_time() - start;
+	
+	spiAdcSequenceType previousType = sequenceType;
+	spiAdcSequenceType types[2] = {spiAdcAutoSequence, spiAdcOnTheFly};
+	int64_t sequenceUs[2] = {0};
+	for(int k = 0; k < 2; k++){
+		sequenceType = types[k];
+		spiAdcSetSequence(channelMask);
+		start = esp_timer_get_time();
+		for(int i = 0; i < rounds; i++){
+			spiAdcGetSequence(data);
+		}
+		sequenceUs[k] = esp_timer_get_time() - start;
+	}
+	sequenceType = previousType;
+	adcMeasureChannel(channels[0]); // leave the adc in manual mode
+	
+	long samples = (long)rounds * count;
+	printf("%ld samples over %d channels\n", samples, count);
+	printf("manual:        %8.0f samples/s\n", samples * 1000000.0 / manualUs);
+	printf("auto sequence: %8.0f samples/s\n", samples * 1000000.0 / sequenceUs[0]);
+	printf("on the fly:    %8.0f samples/s\n", samples * 1000000.0 / sequenceUs[1]);
+}
+
+// A low priority task on the benchmark core counts while it gets cpu time, any time taken away from it is cpu use
+static volatile uint32_t idleCount = 0;
+static volatile bool idleCountEnable = false;
+static void idleCountTask(void *arg){
+	while(idleCountEnable){
+		idleCount++;
+	}
+	vTaskDelete(NULL);
+}
+
+// Returns the idle count rate in counts per us over a window
+static double idleCountRate(int64_t start, uint32_t startCount){
+	return (idleCount - startCount) / (double)(esp_timer_get_time() - start);
+}
+
+// Prints cpu use per thousand samples per second for polling and queued dma reads
+static void spiAdcCpuBenchmark(uint8_t channelMask){
+	int count = 0;
+	for(int i = 0; i < 8; i++){
+		if(channelMask & (1 << i)){
+			count++;
+		}
+	}
+	int rounds = BENCHMARK_SAMPLES / count;
+	uint16_t frame[8] = {0};
+	uint16_t *block = malloc(rounds * count * sizeof(uint16_t));
+	if(block == NULL){
+		printf("Not enough memory for the benchmark\n");
+		return;
+	}
+	
+	idleCount = 0;
+	idleCountEnable = true;
+	xTaskCreatePinnedToCore(idleCountTask, "idleCountTask", 2048, NULL, 1, NULL, xPortGetCoreID());
+	
+	// Baseline with this task blocked
+	int64_t start = esp_timer_get_time();
+	uint32_t startCount = idleCount;
+	vTaskDelay(500 / portTICK_PERIOD_MS);
+	double baseline = idleCountRate(start, startCount);
+	
+	spiAdcSetSequence(channelMask);
+	
+	start = esp_timer_get_time();
+	startCount = idleCount;
+	for(int i = 0; i < rounds; i++){
+		spiAdcGetSequence(frame);
+	}
+	int64_t pollingUs = esp_timer_get_time() - start;
+	double pollingCpu = 1.0 - idleCountRate(start, startCount) / baseline;
+	
+	start = esp_timer_get_time();
+	startCount = idleCount;
+	spiAdcReadSequenceBlock(block, rounds);
+	int64_t dmaUs = esp_timer_get_time() - start;
+	double dmaCpu = 1.0 - idleCountRate(start, startCount) / baseline;
+	
+	idleCountEnable = false;
+	vTaskDelay(10 / portTICK_PERIOD_MS); // let the counter task delete itself
+	free(block);
+	
+	long samples = (long)rounds * count;
+	double pollingKsps = samples * 1000.0 / pollingUs;
+	double dmaKsps = samples * 1000.0 / dmaUs;
+	printf("%ld samples over %d channels\n", samples, count);
+	printf("polling: %7.1f ksps, %5.1f%% cpu, %5.2f%% cpu per ksps\n", pollingKsps, pollingCpu * 100.0, pollingCpu * 100.0 / pollingKsps);
+	printf("dma:     %7.1f ksps, %5.1f%% cpu, %5.2f%% cpu per ksps\n", dmaKsps, dmaCpu * 100.0, dmaCpu * 100.0 / dmaKsps);
+}
+
+// Prints the per sample latency of session reads, the same path the logging task uses
+static void spiAdcLatencyBenchmark(uint8_t channelMask){
+	int count = 0;
+	for(int i = 0; i < 8; i++){
+		if(channelMask & (1 << i)){
+			count++;
+		}
+	}
+	int rounds = BENCHMARK_SAMPLES / count;
+	uint16_t frame[8] = {0};
+	
+	spiAdcSetSequence(channelMask);
+	spiAdcSessionOpen();
+	int64_t worstUs = 0;
+	int64_t start = esp_timer_get_time();
+	for(int i = 0; i < rounds; i++){
+		int64_t roundStart = esp_timer_get_time();
+		spiAdcSessionRead(frame);
+		int64_t roundUs = esp_timer_get_time() - roundStart;
+		if(roundUs > worstUs){
+			worstUs = roundUs;
+		}
+	}
+	int64_t totalUs = esp_timer_get_time() - start;
+	spiAdcSessionClose();
+	
+	long samples = (long)rounds * count;
+	printf("%ld samples over %d channels\n", samples, count);
+	printf("per sample: %2.3f us\n", (double)totalUs / samples);
+	printf("per round:  %2.3f us, worst %lld us\n", (double)totalUs / rounds, worstUs);
+	printf("rate limit: %d Hz from %ld ns per frame and %ld ns per round\n", spiAdcMaxSequenceRate(channelMask, channelAveraging), frameCostNs, roundCostNs);
+}
+
+// Samples the mask slowly while the hardware holds the extremes of every conversion in between
+static void spiAdcPeakHold(uint8_t channelMask, bool convert){
+	uint16_t data[8] = {0};
+	uint16_t maximum[8] = {0};
+	uint16_t minimum[8] = {0};
+	
+	spiAdcSetSequence(channelMask);
+	spiAdcSetPeakHold(true);
+	int64_t start = esp_timer_get_time();
+	while(esp_timer_get_time() - start < 1000000){
+		spiAdcGetSequence(data);
+		vTaskDelay(1); // one round per tick, the peaks come from the hardware
+	}
+	spiAdcReadPeaks(channelMask, maximum, minimum);
+	spiAdcSetPeakHold(false);
+	
+	for(int i = 0; i < 8; i++){
+		if((channelMask & (1 << i)) == 0){
+			continue;
+		}
+		if(convert){
+			printf("%d: last %2.6f, min %2.6f, max %2.6f\n", i, (data[i] / 65535.0) * 5.0, (minimum[i] / 65535.0) * 5.0, (maximum[i] / 65535.0) * 5.0);
+		}else{
+			printf("%d: last 0x%04x, min 0x%04x, max 0x%04x\n", i, data[i], minimum[i], maximum[i]);
+		}
+	}
+}
+
 static int spiAdcDevCommand(int argc, char **argv){
 	static const char* TAG = "dev-spi-adc";
 	
@@ -147,6 +458,10 @@ static int spiAdcDevCommand(int argc, char **argv){
         arg_print_errors(stderr, spi_adc_args.end, argv[0]);
         return 1;
     }
+	if(sessionOpen){ // would wait on the bus until the run is over
+		ESP_LOGE(TAG, "The adc is being sampled by a run.");
+		return 1;
+	}
 	
 	if(spi_adc_args.measure->count != 0){ 
 		int channel = spi_adc_args.measure->ival[0];
@@ -162,9 +477,62 @@ static int spiAdcDevCommand(int argc, char **argv){
 	}
 	
 	if(spi_adc_args.sequence->count != 0){
-		printf("Not yet implemented.\n");
+		int mask = spi_adc_args.sequence->ival[0];
+		if(mask < 1 || mask > 255){
+			ESP_LOGE(TAG, "Invalid channel mask. Must be between 1 and 255.");
+			return 1;
+		}
+		uint16_t data[8] = {0};
+		spiAdcSetSequenceType(spi_adc_args.onTheFly->count != 0 ? spiAdcOnTheFly : spiAdcAutoSequence);
+		spiAdcSetSequence(mask);
+		spiAdcGetSequence(data);
+		for(int i = 0; i < 8; i++){
+			if((mask & (1 << i)) == 0){
+				continue;
+			}
+			if(spi_adc_args.convert->count != 0){
+				printf("%d: %2.6f\n", i, (data[i] / 65535.0) * 5.0);
+			}else{
+				printf("%d: 0x%04x\n", i, data[i]);
+			}
+		}
+	}
+	
+	if(spi_adc_args.benchmark->count != 0){
+		int mask = spi_adc_args.benchmark->ival[0];
+		if(mask < 1 || mask > 255){
+			ESP_LOGE(TAG, "Invalid channel mask. Must be between 1 and 255.");
+			return 1;
+		}
+		spiAdcBenchmark(mask);
+	}
+	
+	if(spi_adc_args.cpuBenchmark->count != 0){
+		int mask = spi_adc_args.cpuBenchmark->ival[0];
+		if(mask < 1 || mask > 255){
+			ESP_LOGE(TAG, "Invalid channel mask. Must be between 1 and 255.");
+			return 1;
+		}
+		spiAdcCpuBenchmark(mask);
+	}
+	
+	if(spi_adc_args.latency->count != 0){
+		int mask = spi_adc_args.latency->ival[0];
+		if(mask < 1 || mask > 255){
+			ESP_LOGE(TAG, "Invalid channel mask. Must be between 1 and 255.");
+			return 1;
+		}
+		spiAdcLatencyBenchmark(mask);
 	}
 	
+	if(spi_adc_args.peaks->count != 0){
+		int mask = spi_adc_args.peaks->ival[0];
+		if(mask < 1 || mask > 255){
+			ESP_LOGE(TAG, "Invalid channel mask. Must be between 1 and 255.");
+			return 1;
+		}
+		spiAdcPeakHold(mask, spi_adc_args.convert->count != 0);
+	}
 	
 	return 0;
 }
@@ -173,6 +541,7 @@ void spiRegisterCommands(){
 	spi_reg_args.address = arg_int1(NULL, NULL, "<uint8>", "ADC Register to address, avoid addressing invalid registers!");
 	spi_reg_args.write = arg_int0("w", NULL, "<uint8>", "Write a value to the address");
 	spi_reg_args.read = arg_lit0("r", NULL, "Read a value from the address");
+	spi_reg_args.cached = arg_lit0("c", NULL, "Read the cached shadow value of the address");
 	spi_reg_args.bit = arg_int0("b", NULL, "<0-7>", "Address a bit position of the register");
 	spi_reg_args.end = arg_end(2);
 	
@@ -186,6 +555,11 @@ void spiRegisterCommands(){
 	
 	spi_adc_args.measure = arg_int0("m", NULL, "<0-7>", "Measure a single ADC analog input");
 	spi_adc_args.sequence = arg_int0("s", NULL, "<uint8>", "Run the ADC sequencer over the channels in the mask");
+	spi_adc_args.onTheFly = arg_lit0("o", NULL, "Use on the fly channel selection for -s");
+	spi_adc_args.benchmark = arg_int0("b", NULL, "<uint8>", "Compare samples per second of each read mode over the mask");
+	spi_adc_args.cpuBenchmark = arg_int0("d", NULL, "<uint8>", "Compare cpu use of polling and queued dma reads over the mask");
+	spi_adc_args.latency = arg_int0("l", NULL, "<uint8>", "Measure the per sample latency of a logging session over the mask");
+	spi_adc_args.peaks = arg_int0("p", NULL, "<uint8>", "Hold the min and max of the channels in the mask for one second");
 	spi_adc_args.convert = arg_lit0("f", NULL, "Display results as floating point");
 	spi_adc_args.end = arg_end(2);
 	
@@ -224,7 +598,7 @@ void addDevice(gpio_num_t csPin, int speed, uint8_t mode, int deviceNumber){
 		.mode = mode, 
 		.clock_speed_hz = speed, 
 		.spics_io_num = csPin,
-		.queue_size = 1, // only 1 in the queue, use semaphores when accessing the driver
+		.queue_size = ADC_QUEUE_SIZE, // deep queue for the dma path, still use semaphores when accessing the driver
 		//.pre_cb =  // no pre transfer call back, could be used to set gpio other than cs
 		//.post_cb =
 		.cs_ena_pretrans = 4
@@ -237,15 +611,45 @@ void removeDevice(int deviceNumber){
 	ESP_ERROR_CHECK(spi_bus_remove_device(deviceHandles[deviceNumber]));
 }
 
+// The task holding the bus, a batch or the session, locks again without waiting, everyone else waits on the semaphore
+bool lockBus(){
+	return lockBusWait(0xffff);
+}
+
+bool lockBusWait(TickType_t ticks){
+	TaskHandle_t self = xTaskGetCurrentTaskHandle();
+	if(busOwner == self){
+		busDepth++;
+		return true;
+	}
+	if(xSemaphoreTake(spiSemaphore, ticks) != pdTRUE){
+		return false;
+	}
+	busOwner = self;
+	busDepth = 1;
+	return true;
+}
+
+void unlockBus(){
+	if(busOwner != xTaskGetCurrentTaskHandle()){
+		return;
+	}
+	busDepth--;
+	if(busDepth == 0){
+		busOwner = NULL;
+		xSemaphoreGive(spiSemaphore); 
+	}
+}
+
 void genericTransmit(int deviceNumber, uint8_t *data, uint8_t len){
 	spi_transaction_t t;
 	memset(&t, 0, sizeof(t));
 	t.length = 8 * len;
 	t.tx_buffer = data;
 	
-	if(xSemaphoreTake(spiSemaphore, 0xffff) == pdTRUE ){
+	if(lockBus()){
 		ESP_ERROR_CHECK(spi_device_polling_transmit(deviceHandles[deviceNumber], &t));
-		xSemaphoreGive(spiSemaphore); 
+		unlockBus();
     }	
 }
 
@@ -255,37 +659,215 @@ void genericRecieve(int deviceNumber, uint8_t *data, uint8_t len){
 	t.length = 8 * len;
 	t.rx_buffer = data;
 	
-	if(xSemaphoreTake(spiSemaphore, 0xffff) == pdTRUE ){
+	if(lockBus()){
 		ESP_ERROR_CHECK(spi_device_polling_transmit(deviceHandles[deviceNumber], &t));
-		xSemaphoreGive(spiSemaphore); 
+		unlockBus();
+    }	
+}
+
+// Transmits len bytes per frame from data, holds the bus for all of the frames so they run back to back
+void genericTransmitFrames(int deviceNumber, uint8_t *data, uint8_t len, int frames){
+	spi_transaction_t t;
+	memset(&t, 0, sizeof(t));
+	t.length = 8 * len;
+	
+	if(lockBus()){
+		for(int i = 0; i < frames; i++){
+			t.tx_buffer = &data[i * len];
+			ESP_ERROR_CHECK(spi_device_polling_transmit(deviceHandles[deviceNumber], &t));
+		}
+		unlockBus();
+    }	
+}
+
+// Recieves len bytes per frame into data, holds the bus for all of the frames so they run back to back
+void genericRecieveFrames(int deviceNumber, uint8_t *data, uint8_t len, int frames){
+	spi_transaction_t t;
+	memset(&t, 0, sizeof(t));
+	t.length = 8 * len;
+	
+	if(lockBus()){
+		for(int i = 0; i < frames; i++){
+			t.rx_buffer = &data[i * len];
+			ESP_ERROR_CHECK(spi_device_polling_transmit(deviceHandles[deviceNumber], &t));
+		}
+		unlockBus();
+    }	
+}
+
+// Same as genericRecieveFrames, but each frame also shifts out its own len bytes of txData
+void genericTransferFrames(int deviceNumber, uint8_t *txData, uint8_t *rxData, uint8_t len, int frames){
+	spi_transaction_t t;
+	memset(&t, 0, sizeof(t));
+	t.length = 8 * len;
+	
+	if(lockBus()){
+		for(int i = 0; i < frames; i++){
+			t.tx_buffer = &txData[i * len];
+			t.rx_buffer = &rxData[i * len];
+			ESP_ERROR_CHECK(spi_device_polling_transmit(deviceHandles[deviceNumber], &t));
+		}
+		unlockBus();
     }	
 }
 
+// The queued functions do not lock the bus, the caller holds it from the first queue to the last collect
+// Polling transmits are not allowed while queued transactions are still in flight
+void genericQueueFrame(int deviceNumber, int slot){
+	ESP_ERROR_CHECK(spi_device_queue_trans(deviceHandles[deviceNumber], &queuedTransactions[slot], portMAX_DELAY));
+}
+
+void genericCollectFrame(int deviceNumber){
+	spi_transaction_t *t;
+	ESP_ERROR_CHECK(spi_device_get_trans_result(deviceHandles[deviceNumber], &t, portMAX_DELAY));
+}
+
 
 //================================== ADC Interface ===========================================
 
+// Volatile and write 1 to clear registers always go to the device
+static bool adcIsCached(uint8_t address){
+	if(address >= ADC_SHADOW_SIZE){
+		return false;
+	}
+	switch(address){
+	case ADC_SYSTEM_STATUS_REG_ADDR:
+	case ADC_GPI_VALUE_REG_ADDR:
+	case ADC_EVENT_FLAG_REG_ADDR:
+	case ADC_EVENT_HIGH_FLAG_REG_ADDR:
+	case ADC_EVENT_LOW_FLAG_REG_ADDR:
+		return false;
+	default:
+		return true;
+	}
+}
+
+void adcInvalidateShadow(){
+	memset(shadowValid, 0, sizeof(shadowValid));
+}
+
+// Adds a raw frame to the burst, commits early if the burst is full
+void adcStageFrame(uint8_t command, uint8_t address, uint8_t data){
+	if(stagedCount == ADC_MAX_STAGED_FRAMES){
+		genericTransmitFrames(ADC_DEVICE_NUMBER, stagedFrames, 3, stagedCount);
+		stagedCount = 0;
+	}
+	stagedFrames[stagedCount * 3] = command;
+	stagedFrames[stagedCount * 3 + 1] = address;
+	stagedFrames[stagedCount * 3 + 2] = data;
+	stagedCount++;
+}
+
+// Waits for any other batch or session, a change to the adc state never lands in the middle of someone else's
+void adcBeginBatch(){
+	lockBusWait(portMAX_DELAY);
+	batchDepth++;
+}
+
+// Sends every staged frame back to back under one bus lock
+void adcCommitBatch(){
+	if(batchDepth == 0){
+		return;
+	}
+	batchDepth--;
+	if(batchDepth == 0){
+		adcFlushStaged();
+	}
+	unlockBus();
+}
+
+// Anything staged has to land before a read, the staged frames belong to whoever holds the bus
+void adcFlushStaged(){
+	lockBusWait(portMAX_DELAY);
+	if(stagedCount != 0){
+		genericTransmitFrames(ADC_DEVICE_NUMBER, stagedFrames, 3, stagedCount);
+		stagedCount = 0;
+	}
+	unlockBus();
+}
+
+// Writes that would not change a cached register are dropped
 void adcWriteRegister(uint8_t address, uint8_t data){
-	uint8_t txBuffer[3] = {0x08, address, data}; // write command, register address, data
-	genericTransmit(ADC_DEVICE_NUMBER, txBuffer, 3);
+	adcBeginBatch();
+	if(adcIsCached(address)){
+		if(shadowValid[address] && shadowRegisters[address] == data){
+			adcCommitBatch();
+			return;
+		}
+		shadowRegisters[address] = data;
+		if(address == ADC_GENERAL_CFG_REG_ADDR){
+			shadowRegisters[address] &= ~ADC_GENERAL_CFG_SELF_CLEARING;
+		}
+		shadowValid[address] = true;
+	}
+	
+	adcStageFrame(ADC_CMD_WRITE, address, data); // write command, register address, data
+	adcCommitBatch();
 }
 
+// Always reads the device, refreshes the shadow
 uint8_t adcReadRegister(uint8_t address){
-	uint8_t txBuffer[3] = {0x10, address, 0x00}; // read command, register address, dummy
+	adcFlushStaged();
+	
+	uint8_t txBuffer[3] = {ADC_CMD_READ, address, 0x00}; // read command, register address, dummy
 	genericTransmit(ADC_DEVICE_NUMBER, txBuffer, 3);
 
 	uint8_t rxBuffer[3] = {0}; // read 3 bytes for timing
 	genericRecieve(ADC_DEVICE_NUMBER, rxBuffer, 3);
+	
+	if(adcIsCached(address)){
+		shadowRegisters[address] = rxBuffer[0];
+		shadowValid[address] = true;
+	}
 	return rxBuffer[0];
 }
 
+// Pipelined reads, each frame shifts out the register asked for in the frame before it
+// count reads take count + 1 frames instead of 2 * count
+void adcReadRegisters(const uint8_t *addresses, uint8_t *values, int count){
+	adcFlushStaged();
+	
+	uint8_t txBuffer[(ADC_MAX_REGISTER_READS + 1) * 3] = {0};
+	uint8_t rxBuffer[(ADC_MAX_REGISTER_READS + 1) * 3] = {0};
+	for(int i = 0; i < count; i++){
+		txBuffer[i * 3] = ADC_CMD_READ;
+		txBuffer[i * 3 + 1] = addresses[i];
+	}
+	genericTransferFrames(ADC_DEVICE_NUMBER, txBuffer, rxBuffer, 3, count + 1);
+	
+	for(int i = 0; i < count; i++){
+		values[i] = rxBuffer[(i + 1) * 3];
+		if(adcIsCached(addresses[i])){
+			shadowRegisters[addresses[i]] = values[i];
+			shadowValid[addresses[i]] = true;
+		}
+	}
+}
+
+// Only reads the device the first time a cached register is used
+uint8_t adcGetRegister(uint8_t address){
+	if(adcIsCached(address) && shadowValid[address]){
+		return shadowRegisters[address];
+	}
+	return adcReadRegister(address);
+}
+
+// One frame, the shadow supplies the rest of the register, or the set/clear bit command is used if there is no shadow
 void adcWriteBit(uint8_t address, uint8_t bit, bool value){
-	uint8_t temp = adcReadRegister(address);
-	if(value == 0){
-		temp = temp & ~(1 << bit);
-	}else{
-		temp = temp | (1 << bit);
+	if(adcIsCached(address) && shadowValid[address]){
+		uint8_t temp = shadowRegisters[address];
+		if(value == 0){
+			temp = temp & ~(1 << bit);
+		}else{
+			temp = temp | (1 << bit);
+		}
+		adcWriteRegister(address, temp);
+		return;
 	}
-	adcWriteRegister(address, temp);
+	
+	adcBeginBatch();
+	adcStageFrame(value ? ADC_CMD_SET_BIT : ADC_CMD_CLEAR_BIT, address, 1 << bit);
+	adcCommitBatch();
 }
 
 bool adcReadBit(uint8_t address, uint8_t bit){
@@ -294,74 +876,590 @@ bool adcReadBit(uint8_t address, uint8_t bit){
 }
 
 void adcInit(){
-	if(adcReadBit(0x00, 2)){ // error on startup
+	adcInvalidateShadow();
+	
+	if(adcReadBit(ADC_SYSTEM_STATUS_REG_ADDR, 2)){ // error on startup
 		printf("SPI ADC error on startup, automatic reset triggered.");
-		adcWriteBit(0x01, 0, 1); // reset the device
-		adcWriteBit(0x00, 0, 1); // clear the brown out flag, can check later to see if device is browned out
-	}else if(adcReadBit(0,0)){
+		adcWriteBit(ADC_GENERAL_CFG_REG_ADDR, 0, 1); // reset the device
+		adcInvalidateShadow(); // every register is back to its reset value
+		adcWriteBit(ADC_SYSTEM_STATUS_REG_ADDR, 0, 1); // clear the brown out flag, can check later to see if device is browned out
+	}else if(adcReadBit(ADC_SYSTEM_STATUS_REG_ADDR, 0)){
 		printf("SPI ADC brownout detected on initialization.");
-		adcWriteBit(0x00, 0, 1); // clear the brown out flag, can check later to see if device is browned out
+		adcWriteBit(ADC_SYSTEM_STATUS_REG_ADDR, 0, 1); // clear the brown out flag, can check later to see if device is browned out
 	}
 	
 	
-	sequencerMode = 0; // starts in manual mode
-	adcWriteRegister(0x01, 0x06); // Force all channels to be analog inputs, calibrate ADC offset
-	//adcWriteRegister(0x02, 0x10); // Append 4 bit channel ID to the ADC data
-	adcWriteRegister(0x02, 0x00);
-	//adcWriteRegister(0x02, 0x90); // This makes all adc readings come back as a5a for testing
-	adcWriteRegister(0x04, 0x00); // Conv mode = Manual mode
-	adcWriteRegister(0x05, 0x00); // pin config as adc inputs, should be irrelevand due to forced overide
-	adcWriteRegister(0x10, 0x00); // seq mode = manual mode
+	adcMode = adcManualMode; // starts in manual mode
+	adcBeginBatch(); // the whole configuration goes out in one burst
+	adcWriteRegister(ADC_GENERAL_CFG_REG_ADDR, 0x06); // Force all channels to be analog inputs, calibrate ADC offset
+	adcWriteRegister(ADC_DATA_CFG_REG_ADDR, 0x10); // Append 4 bit channel ID to the ADC data, used to align the sequencer
+	//adcWriteRegister(ADC_DATA_CFG_REG_ADDR, 0x00);
+	//adcWriteRegister(ADC_DATA_CFG_REG_ADDR, 0x90); // This makes all adc readings come back as a5a for testing
+	adcWriteRegister(ADC_OPMODE_CFG_REG_ADDR, 0x00); // Conv mode = Manual mode
+	adcWriteRegister(ADC_PIN_CFG_REG_ADDR, 0x00); // pin config as adc inputs, should be irrelevand due to forced overide
+	adcWriteRegister(ADC_SEQUENCE_CFG_REG_ADDR, 0x00); // seq mode = manual mode
+	adcWriteRegister(ADC_CHANNEL_SEL_REG_ADDR, 0x00); // manual channel = 0
 	
-	//adcWriteRegister(0x03, 0x02); // 4 sample averaging
-	adcWriteRegister(0x03, 0x03); // 8 sample averaging
+	//adcWriteRegister(ADC_OSR_CFG_REG_ADDR, 0x02); // 4 sample averaging
+	adcWriteRegister(ADC_OSR_CFG_REG_ADDR, 0x03); // 8 sample averaging
+	adcCommitBatch();
 }
 
 // 12 bit data, left padded 0s, only works if not in sequencer mode
 // THIS IS RELATIVELY SLOW
-static int currentChannel = 0;
 uint16_t adcMeasureChannel(int channel){
 	
-	//if(sequencerMode == 1){ // must put the adc back into manual mode first
-	//	adcWriteRegister(0x04, 0x00); // Conv mode = Manual mode
-	//	adcWriteRegister(0x10, 0x00); // seq mode = manual mode
-	//}
-	
 	if(channel < 0 || channel > 7){
 		printf("Invalid ADC channel to read during single conversion");
 		return 0;
 	}
 	
-	if(currentChannel != channel){
-		currentChannel = channel;
-		uint8_t txBuffer[3] = {0x08, 0x11, channel}; // write command, channel sel register, channel number
-		genericTransmit(ADC_DEVICE_NUMBER, txBuffer, 3);
+	lockBusWait(portMAX_DELAY); // held through the reads, a sequence change in between would switch the channel
+	adcBeginBatch();
+	if(adcMode != adcManualMode){ // must put the adc back into manual mode first
+		adcWriteRegister(ADC_SEQUENCE_CFG_REG_ADDR, 0x00); // seq mode = manual mode, stops the sequence
+		adcMode = adcManualMode;
 	}
+	adcWriteRegister(ADC_CHANNEL_SEL_REG_ADDR, channel); // only sent if the channel changed
+	adcWriteRegister(ADC_OSR_CFG_REG_ADDR, averagingCode(channelAveraging[channel])); // only sent if the ratio changed
+	adcCommitBatch();
 
 	//vTaskDelay(10/ portTICK_PERIOD_MS); // testing
 	uint8_t rxBuffer[3] = {0};
 	genericRecieve(ADC_DEVICE_NUMBER, rxBuffer, 3); // Throw away
+	esp_rom_delay_us(channelAveraging[channel] * ADC_CONVERSION_US); // let the averaged conversion finish
 	genericRecieve(ADC_DEVICE_NUMBER, rxBuffer, 3); // This is valid
+	bool averaged = channelAveraging[channel] > 1;
+	unlockBus();
+	
+	// 12bits of data + 4 bits of channel id, or 16 bits of averaged data + 4 bits of channel id
+	uint8_t id = 0;
+	return adcDecodeFrame(rxBuffer, averaged, &id);
+}
+
+// 16 bits of averaged data followed by the 4 bit channel ID
+// Without averaging the ADC only sends 12 bits and the channel ID moves up into the bottom nibble of the second byte
+// Either way the result is returned as a 16 bit left justified code
+// In IRAM since the session read path uses it
+IRAM_ATTR uint16_t adcDecodeFrame(uint8_t *rxBuffer, bool averaged, uint8_t *channel){
+	if(averaged){
+		*channel = rxBuffer[2] >> 4;
+		return 0 | (rxBuffer[0] << 8) | rxBuffer[1];
+	}
+	*channel = rxBuffer[1] & 0x0F;
+	return 0 | (rxBuffer[0] << 8) | (rxBuffer[1] & 0xF0);
+}
+
+// In on the fly mode the first 5 bits of every frame are a 1 followed by the channel for the next conversion
+// The data shifted out in the same frame is from the channel selected in the previous frame
+static uint8_t onTheFlyCommand(uint8_t channel){
+	return 0x80 | (channel << 3);
+}
+
+// OSR_CFG holds log2 of the averaging ratio
+static uint8_t averagingCode(uint8_t averaging){
+	uint8_t code = 0;
+	while((1 << (code + 1)) <= averaging && code < 7){
+		code++;
+	}
+	return code;
+}
+
+// Builds the frames for one round of the sequence
+// OSR is global on the ADS7028, so mixed averaging runs in on the fly mode with the channels grouped by ratio
+// Each group costs an OSR write and a flush frame, a single ratio costs nothing extra
+// Returns the number of frames
+static int buildRound(uint8_t channelMask, const uint8_t *averaging, bool onTheFly, adcFrameType *frames){
+	uint8_t channels[8];
+	int count = 0;
+	uint8_t groups[8]; // distinct ratios in ascending order
+	int groupCount = 0;
+	for(int i = 0; i < 8; i++){
+		if((channelMask & (1 << i)) == 0){
+			continue;
+		}
+		channels[count++] = i;
+		
+		int g = 0;
+		while(g < groupCount && groups[g] < averaging[i]){
+			g++;
+		}
+		if(g == groupCount || groups[g] != averaging[i]){
+			memmove(&groups[g + 1], &groups[g], groupCount - g);
+			groups[g] = averaging[i];
+			groupCount++;
+		}
+	}
+	if(count == 0){
+		return 0;
+	}
+	
+	int length = 0;
+	memset(frames, 0, ADC_MAX_ROUND_FRAMES * sizeof(adcFrameType));
+	
+	if(groupCount == 1){ // one ratio, the pipeline wraps from the last channel back to the first
+		for(int i = 0; i < count; i++){
+			if(onTheFly){
+				frames[length].tx[0] = onTheFlyCommand(channels[(i + 1) % count]);
+			}
+			frames[length].channel = channels[i];
+			frames[length].averaged = groups[0] > 1;
+			frames[length].waitUs = groups[0] * ADC_CONVERSION_US;
+			length++;
+		}
+		return length;
+	}
+	
+	// The round ends on a throw away conversion at the last group's ratio
+	int previousUs = groups[groupCount - 1] * ADC_CONVERSION_US;
+	for(int g = 0; g < groupCount; g++){
+		int conversionUs = groups[g] * ADC_CONVERSION_US;
+		
+		frames[length].tx[0] = ADC_CMD_WRITE;
+		frames[length].tx[1] = ADC_OSR_CFG_REG_ADDR;
+		frames[length].tx[2] = averagingCode(groups[g]);
+		frames[length].channel = -1;
+		frames[length].waitUs = previousUs;
+		length++;
+		
+		// The write frame also starts a conversion and it is not clear which ratio it gets, wait for the longer one
+		int writeUs = (conversionUs > previousUs) ? conversionUs : previousUs;
+		uint8_t groupChannels[8];
+		int groupSize = 0;
+		for(int i = 0; i < count; i++){
+			if(averaging[channels[i]] == groups[g]){
+				groupChannels[groupSize++] = channels[i];
+			}
+		}
+		
+		// Select the first channel, then each frame reads the previous one, the last frame only flushes
+		for(int k = 0; k <= groupSize; k++){
+			frames[length].tx[0] = onTheFlyCommand(groupChannels[(k < groupSize) ? k : 0]);
+			frames[length].channel = (k == 0) ? -1 : groupChannels[k - 1];
+			frames[length].averaged = groups[g] > 1;
+			frames[length].waitUs = (k == 0) ? writeUs : conversionUs;
+			length++;
+		}
+		previousUs = conversionUs;
+	}
+	return length;
+}
+
+// The fastest sample rate the sequence can keep up with, frames plus the conversion waits between them
+// The frame and round costs come from timing real session reads, the wire time alone leaves out the driver and CS overhead
+int spiAdcMaxSequenceRate(uint8_t channelMask, const uint8_t *averaging){
+	adcFrameType frames[ADC_MAX_ROUND_FRAMES];
+	int length = buildRound(channelMask, averaging, sequenceType == spiAdcOnTheFly, frames);
+	if(length == 0){
+		return 0;
+	}
+	
+	int64_t roundNs = roundCostNs;
+	for(int i = 0; i < length; i++){
+		roundNs += frameCostNs + frames[i].waitUs * 1000LL;
+	}
+	return 1000000000LL / roundNs;
+}
+
+// Times session rounds of one channel and of all eight, the same reads the logging task makes
+// The difference between the two is the cost of a frame, what is left of the short round is the cost of a round
+static void calibrateSequenceRate(){
+	static const char* TAG = "spi";
+	const uint8_t masks[2] = {0x01, 0xFF};
+	int frames[2];
+	int64_t roundNs[2];
+	uint16_t data[8];
+	
+	for(int m = 0; m < 2; m++){
+		spiAdcSetSequence(masks[m]);
+		spiAdcSessionOpen();
+		if(sessionOpen == false){
+			spiAdcSetSequence(0);
+			return; // keeps the wire time estimate
+		}
+		int64_t waitUs = 0;
+		for(int i = 0; i < roundLength; i++){
+			waitUs += roundFrames[i].waitUs;
+		}
+		int64_t start = esp_timer_get_time();
+		for(int r = 0; r < ADC_CALIBRATION_ROUNDS; r++){
+			spiAdcSessionRead(data);
+		}
+		int64_t totalUs = esp_timer_get_time() - start;
+		spiAdcSessionClose();
+		frames[m] = roundLength;
+		roundNs[m] = (totalUs * 1000) / ADC_CALIBRATION_ROUNDS - waitUs * 1000;
+	}
+	spiAdcSetSequence(0); // back to manual mode
+	
+	if(frames[1] > frames[0]){
+		frameCostNs = (roundNs[1] - roundNs[0]) / (frames[1] - frames[0]);
+	}
+	if(frameCostNs < ADC_FRAME_US * 1000){
+		frameCostNs = ADC_FRAME_US * 1000;
+	}
+	roundCostNs = roundNs[0] - frames[0] * (int64_t)frameCostNs;
+	if(roundCostNs < 0){
+		roundCostNs = 0;
+	}
+	ESP_LOGI(TAG, "Sequence frames cost %ld ns, rounds %ld ns on top", frameCostNs, roundCostNs);
+}
+
+// Samples averaged per conversion for each of the 8 channels, 1 to 128 in powers of 2
+void spiAdcSetAveraging(const uint8_t *averaging){
+	uint8_t ratios[8];
+	for(int i = 0; i < 8; i++){
+		uint8_t value = averaging[i];
+		if(value < 1){
+			value = 1;
+		}
+		if(value > 128){
+			value = 128;
+		}
+		ratios[i] = 1 << averagingCode(value); // round down to a power of 2
+	}
 	
-	// 12bits of data + 4 bits of channel id
-	// move the 8MSB data bits into 11 downto 4, move the 4LSB into 3 downto 0, drop the channel id
-	//return 0 | (rxBuffer[0] << 4) | (rxBuffer[1] >> 4);
-	return 0| (rxBuffer[0] << 8) | rxBuffer[1];
+	adcBeginBatch(); // the ratios are part of the round plan, changed under the bus like the sequence
+	for(int i = 0; i < 8; i++){
+		channelAveraging[i] = ratios[i];
+	}
+	
+	if(adcMode != adcManualMode){ // rebuild the running sequence with the new ratios
+		spiAdcSetSequence(sequenceMask);
+	}
+	adcCommitBatch();
 }
 
+void spiAdcSetSequenceType(spiAdcSequenceType type){
+	adcBeginBatch();
+	sequenceType = type;
+	if(adcMode != adcManualMode){ // switch the running sequence over to the new type
+		spiAdcSetSequence(sequenceMask);
+	}
+	adcCommitBatch();
+}
+
+// Conversions are still started by the CS rising edge, the sequencer only picks the next channel
+// Conv mode stays in manual, autonomous mode is for the internal oscillator and would not follow CS
 void spiAdcSetSequence(uint8_t channelMask){
-	if(sequencerMode == 0){ // put into sequencer mode
-		adcWriteRegister(0x04, 0x20); // Conv mode = Auto 
-		adcWriteRegister(0x10, 0x01); // seq mode = sequencer
+	adcBeginBatch(); // the stop, channel selection and restart go out as one burst
+	adcWriteRegister(ADC_SEQUENCE_CFG_REG_ADDR, 0x00); // stop the sequence before changing the channel selection
+	
+	sequenceMask = channelMask;
+	sequenceLength = 0;
+	bool mixed = false;
+	for(int i = 0; i < 8; i++){
+		if(channelMask & (1 << i)){
+			sequenceChannels[sequenceLength] = i;
+			sequenceIndex[i] = sequenceLength;
+			if(channelAveraging[i] != channelAveraging[sequenceChannels[0]]){
+				mixed = true;
+			}
+			sequenceLength++;
+		}
+	}
+	
+	// Mixed ratios reprogram OSR between groups, which only works when the host picks every channel
+	bool onTheFly = (sequenceType == spiAdcOnTheFly) || mixed;
+	roundLength = buildRound(channelMask, channelAveraging, onTheFly, roundFrames);
+	
+	roundQueueable = true;
+	for(int i = 0; i < roundLength; i++){
+		if(roundFrames[i].waitUs > ADC_QUEUED_GAP_US){
+			roundQueueable = false;
+		}
 	}
 	
-	adcWriteRegister(0x12, channelMask); // writes the selected channels into the auto seq ch sel register
-	adcWriteRegister(0x10, 0x11); // seq mode = sequencer, set start = true
+	if(sequenceLength == 0){ // nothing to sequence, stay in manual mode
+		adcMode = adcManualMode;
+	}else if(mixed){
+		adcWriteRegister(ADC_SEQUENCE_CFG_REG_ADDR, 0x02); // seq mode = on the fly
+		shadowValid[ADC_OSR_CFG_REG_ADDR] = false; // the round writes OSR itself, outside of the shadow
+		adcMode = adcOnTheFlyMode;
+	}else if(onTheFly){
+		adcWriteRegister(ADC_OSR_CFG_REG_ADDR, averagingCode(channelAveraging[sequenceChannels[0]])); // only sent if it changed
+		adcWriteRegister(ADC_SEQUENCE_CFG_REG_ADDR, 0x02); // seq mode = on the fly
+		// Prime the pipeline so the first channel is converted at the end of this frame
+		adcStageFrame(onTheFlyCommand(sequenceChannels[0]), 0x00, 0x00);
+		adcMode = adcOnTheFlyMode;
+	}else{
+		adcWriteRegister(ADC_OSR_CFG_REG_ADDR, averagingCode(channelAveraging[sequenceChannels[0]])); // only sent if it changed
+		adcWriteRegister(ADC_AUTO_SEQ_CH_SEL_REG_ADDR, channelMask); // writes the selected channels into the auto seq ch sel register
+		adcWriteRegister(ADC_SEQUENCE_CFG_REG_ADDR, 0x11); // seq mode = sequencer, set start = true
+		adcMode = adcAutoSequenceMode;
+	}
+	
+	// A session switching channel sets between phases keeps reading with the new frames
+	if(sessionOpen && sessionOwner == xTaskGetCurrentTaskHandle()){
+		for(int i = 0; i < roundLength; i++){
+			fillQueuedFrame(i, i);
+		}
+	}
+	adcCommitBatch();
 }
 
+// Groups register changes, including spiAdcSetSequence, into a single burst of frames
+void spiAdcBeginBatch(){
+	adcBeginBatch();
+}
+
+void spiAdcCommitBatch(){
+	adcCommitBatch();
+}
+
+// The hardware tracks the min and max code of every conversion while statistics are enabled
+// Enabling also clears the registers, so peaks are held from this call on
+void spiAdcSetPeakHold(bool enable){
+	adcBeginBatch();
+	if(enable){
+		// Always sent, the shadow would drop the write if the bit was already set
+		adcStageFrame(ADC_CMD_SET_BIT, ADC_GENERAL_CFG_REG_ADDR, 1 << ADC_GENERAL_CFG_STATS_EN_BIT);
+		if(shadowValid[ADC_GENERAL_CFG_REG_ADDR]){
+			shadowRegisters[ADC_GENERAL_CFG_REG_ADDR] |= 1 << ADC_GENERAL_CFG_STATS_EN_BIT;
+		}
+	}else{
+		adcWriteBit(ADC_GENERAL_CFG_REG_ADDR, ADC_GENERAL_CFG_STATS_EN_BIT, 0);
+	}
+	adcCommitBatch();
+}
+
+// Register frames break the channel pipeline of a running sequence, put it back to the start of a round
+static void adcResyncSequence(){
+	if(adcMode == adcAutoSequenceMode){ // restarting goes back to the lowest channel
+		adcStageFrame(ADC_CMD_WRITE, ADC_SEQUENCE_CFG_REG_ADDR, 0x00);
+		adcStageFrame(ADC_CMD_WRITE, ADC_SEQUENCE_CFG_REG_ADDR, 0x11);
+	}else if(adcMode == adcOnTheFlyMode && roundFrames[0].channel >= 0){ // mixed rounds start with an OSR write and prime themselves
+		adcStageFrame(onTheFlyCommand(sequenceChannels[0]), 0x00, 0x00);
+	}
+}
+
+// Reads and resets the held min and max codes of the channels in the mask, both hold 8 entries indexed by channel
+// Safe to call between reads of a running sequence or session, the next round starts clean
+void spiAdcReadPeaks(uint8_t channelMask, uint16_t *maximum, uint16_t *minimum){
+	uint8_t addresses[ADC_MAX_REGISTER_READS];
+	uint8_t values[ADC_MAX_REGISTER_READS];
+	int count = 0;
+	for(int i = 0; i < 8; i++){
+		if(channelMask & (1 << i)){
+			addresses[count++] = ADC_MAX_CH0_LSB_REG_ADDR + 2 * i;
+			addresses[count++] = ADC_MAX_CH0_LSB_REG_ADDR + 2 * i + 1;
+			addresses[count++] = ADC_MIN_CH0_LSB_REG_ADDR + 2 * i;
+			addresses[count++] = ADC_MIN_CH0_LSB_REG_ADDR + 2 * i + 1;
+		}
+	}
+	if(count == 0){
+		return;
+	}
+	adcReadRegisters(addresses, values, count);
+	
+	int index = 0;
+	for(int i = 0; i < 8; i++){
+		if(channelMask & (1 << i)){
+			maximum[i] = values[index] | (values[index + 1] << 8);
+			minimum[i] = values[index + 2] | (values[index + 3] << 8);
+			index += 4;
+		}
+	}
+	
+	adcBeginBatch(); // reset and resync go out together
+	spiAdcSetPeakHold(true);
+	adcResyncSequence();
+	adcCommitBatch();
+}
+
+// Places the results of a round by channel, rxData holds stride bytes per frame
+// Thrown away frames are skipped, the appended channel ID decides where a result goes
+IRAM_ATTR static void decodeRound(uint8_t *rxData, int stride, uint16_t *data){
+	for(int i = 0; i < roundLength; i++){
+		if(roundFrames[i].channel < 0){
+			continue;
+		}
+		uint8_t channel = 0;
+		uint16_t value = adcDecodeFrame(&rxData[i * stride], roundFrames[i].averaged, &channel);
+		if(channel < 8 && (sequenceMask & (1 << channel))){
+			data[channel] = value;
+		}
+	}
+}
+
+// Reads one round of the sequence, one SPI frame per enabled channel plus any OSR changes
+// data must hold 8 entries, results are placed by channel number using the appended channel ID
+// Channels that are not in the sequence are left untouched
 void spiAdcGetSequence(uint16_t *data){
-	if(sequencerMode == 0){
-		// DO NOT LET THIS HAPPEN, i have not thought of a good way to handle this
+	if(lockBus() == false){ // the round plan is read under the bus, nothing can rebuild it halfway through
+		return;
+	}
+	if(adcMode == adcManualMode){ // the sequence was stopped by a single channel read, restart it
+		spiAdcSetSequence(sequenceMask);
+		if(adcMode == adcManualMode){
+			unlockBus();
+			return;
+		}
+	}
+	
+	uint8_t rxBuffer[ADC_MAX_ROUND_FRAMES * 3] = {0};
+	spi_transaction_t t;
+	memset(&t, 0, sizeof(t));
+	t.length = 8 * 3;
+	
+	for(int i = 0; i < roundLength; i++){
+		esp_rom_delay_us(roundFrames[i].waitUs); // let the previous conversion finish
+		t.tx_buffer = roundFrames[i].tx;
+		t.rx_buffer = &rxBuffer[i * 3];
+		ESP_ERROR_CHECK(spi_device_polling_transmit(deviceHandles[ADC_DEVICE_NUMBER], &t));
+	}
+	
+	decodeRound(rxBuffer, 3, data);
+	unlockBus();
+}
+
+// Copies a frame of the round into a dma slot
+static void fillQueuedFrame(int slot, long frame){
+	uint8_t *tx = &queuedTx[slot * ADC_DMA_SLOT_BYTES];
+	memset(tx, 0, ADC_DMA_SLOT_BYTES);
+	memcpy(tx, roundFrames[frame % roundLength].tx, ADC_FRAME_BYTES);
+}
+
+// Queues one round of the sequence for the dma and returns while the bus is still shifting
+// Must be followed by spiAdcFinishSequence, the bus stays locked until then
+// Rounds with conversions longer than the gap between queued frames are read by polling in spiAdcFinishSequence
+void spiAdcStartSequence(){
+	if(adcMode == adcManualMode){
+		spiAdcSetSequence(sequenceMask);
+		if(adcMode == adcManualMode){
+			return;
+		}
 	}
 	
-}
\ No newline at end of file
+	if(roundQueueable == false){
+		return;
+	}
+	
+	if(lockBus()){
+		for(int i = 0; i < roundLength; i++){
+			fillQueuedFrame(i, i);
+			genericQueueFrame(ADC_DEVICE_NUMBER, i);
+		}
+	}
+}
+
+// Waits for the round queued by spiAdcStartSequence, same output as spiAdcGetSequence
+void spiAdcFinishSequence(uint16_t *data){
+	if(adcMode == adcManualMode){ // nothing was queued
+		return;
+	}
+	
+	if(roundQueueable == false){
+		spiAdcGetSequence(data);
+		return;
+	}
+	
+	for(int i = 0; i < roundLength; i++){
+		genericCollectFrame(ADC_DEVICE_NUMBER);
+	}
+	unlockBus();
+	
+	decodeRound(queuedRx, ADC_DMA_SLOT_BYTES, data);
+}
+
+// Reads rounds of the sequence back to back, keeping the dma queue full the whole time
+// data holds one sample per enabled channel per round, in channel order
+void spiAdcReadSequenceBlock(uint16_t *data, int rounds){
+	if(adcMode == adcManualMode){
+		spiAdcSetSequence(sequenceMask);
+		if(adcMode == adcManualMode){
+			return;
+		}
+	}
+	
+	if(roundQueueable == false){
+		uint16_t frame[8] = {0};
+		for(int r = 0; r < rounds; r++){
+			spiAdcGetSequence(frame);
+			for(int i = 0; i < sequenceLength; i++){
+				data[r * sequenceLength + i] = frame[sequenceChannels[i]];
+			}
+		}
+		return;
+	}
+	
+	long frames = (long)rounds * roundLength;
+	long queued = 0;
+	if(lockBus()){
+		while(queued < frames && queued < ADC_QUEUE_SIZE){
+			fillQueuedFrame(queued, queued);
+			genericQueueFrame(ADC_DEVICE_NUMBER, queued);
+			queued++;
+		}
+		
+		// Results come back in queue order, so frame f always lives in slot f % ADC_QUEUE_SIZE
+		for(long f = 0; f < frames; f++){
+			int slot = f % ADC_QUEUE_SIZE;
+			adcFrameType *frame = &roundFrames[f % roundLength];
+			genericCollectFrame(ADC_DEVICE_NUMBER);
+			
+			uint8_t channel = 0;
+			uint16_t value = adcDecodeFrame(&queuedRx[slot * ADC_DMA_SLOT_BYTES], frame->averaged, &channel);
+			if(frame->channel >= 0 && channel < 8 && (sequenceMask & (1 << channel))){
+				data[(f / roundLength) * sequenceLength + sequenceIndex[channel]] = value;
+			}
+			
+			if(queued < frames){
+				fillQueuedFrame(slot, queued);
+				genericQueueFrame(ADC_DEVICE_NUMBER, slot);
+				queued++;
+			}
+		}
+		unlockBus();
+	}
+}
+
+// Opens an exclusive session for the current sequence, the bus and spiSemaphore are held until the session is closed
+// The descriptors are built once here so every read is only the wire time plus the polling loop
+void spiAdcSessionOpen(){
+	if(lockBus() == false){
+		return;
+	}
+	if(adcMode == adcManualMode){
+		spiAdcSetSequence(sequenceMask);
+		if(adcMode == adcManualMode){
+			unlockBus();
+			return;
+		}
+	}
+	
+	ESP_ERROR_CHECK(spi_device_acquire_bus(deviceHandles[ADC_DEVICE_NUMBER], portMAX_DELAY));
+	sessionOwner = xTaskGetCurrentTaskHandle();
+	
+	// A round always starts on the first channel, so the frames never change
+	for(int i = 0; i < roundLength; i++){
+		fillQueuedFrame(i, i);
+	}
+	sessionOpen = true;
+}
+
+// Same output as spiAdcGetSequence, only valid while a session is open
+IRAM_ATTR void spiAdcSessionRead(uint16_t *data){
+	if(sessionOpen == false){
+		return;
+	}
+	
+	spi_device_handle_t handle = deviceHandles[ADC_DEVICE_NUMBER];
+	for(int i = 0; i < roundLength; i++){
+		esp_rom_delay_us(roundFrames[i].waitUs); // let the previous conversion finish
+		spi_device_polling_start(handle, &queuedTransactions[i], portMAX_DELAY);
+		spi_device_polling_end(handle, portMAX_DELAY);
+	}
+	
+	decodeRound(queuedRx, ADC_DMA_SLOT_BYTES, data);
+}
+
+void spiAdcSessionClose(){
+	if(sessionOpen == false){
+		return;
+	}
+	sessionOpen = false;
+	sessionOwner = NULL;
+	spi_device_release_bus(deviceHandles[ADC_DEVICE_NUMBER]);
+	unlockBus(); 
+}
@@ -21,8 +21,38 @@ extern void spiDeinit();
 extern uint16_t spiAdcRead(int channel);
 extern float spiAdcReadFloat(int channel);
 
+typedef enum{
+	spiAdcAutoSequence, spiAdcOnTheFly
+} spiAdcSequenceType;
+
+// Multi channel read, one SPI frame per channel, data holds 8 entries indexed by channel
+extern void spiAdcSetSequenceType(spiAdcSequenceType type);
 extern void spiAdcSetSequence(uint8_t channelMask);
 extern void spiAdcGetSequence(uint16_t *data);
+
+// Samples averaged per conversion for each of the 8 channels, 1 to 128, mixed ratios are reprogrammed between channels
+extern void spiAdcSetAveraging(const uint8_t *averaging);
+extern int spiAdcMaxSequenceRate(uint8_t channelMask, const uint8_t *averaging);
+
+// Groups register changes, including spiAdcSetSequence, into a single burst of frames
+extern void spiAdcBeginBatch();
+extern void spiAdcCommitBatch();
+
+// Queued dma version of spiAdcGetSequence, the cpu is free between start and finish
+extern void spiAdcStartSequence();
+extern void spiAdcFinishSequence(uint16_t *data);
+
+// Back to back rounds through the dma queue, data holds one sample per enabled channel per round
+extern void spiAdcReadSequenceBlock(uint16_t *data, int rounds);
+
+// Hardware min and max of every conversion, read and reset together, data holds 8 entries indexed by channel
+extern void spiAdcSetPeakHold(bool enable);
+extern void spiAdcReadPeaks(uint8_t channelMask, uint16_t *maximum, uint16_t *minimum);
+
+// Exclusive low overhead reads of the current sequence, holds the bus from open to close
+extern void spiAdcSessionOpen();
+extern void spiAdcSessionRead(uint16_t *data);
+extern void spiAdcSessionClose();
 //extern void spiAdcGetSequenceFloat(float *data);
 
 // Console Interface
@@ -0,0 +1,468 @@
+/********************************************************************************
+ * File Name          : summary.c
+ * Author             : Jack Shaver
+ * Date               : 10/17/2026
+ * Description        : Log Summary Source
+ ********************************************************************************/
+
+#include "summary.h"
+#include "logging.h"
+#include "sd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h" // levels live in the psram next to the capture arena
+#include "esp_rom_crc.h"
+
+#include "esp_console.h"
+#include "argtable3/argtable3.h" // command creation
+
+#define SUMMARY_MAX_BYTES (1024 * 1024) // the finest levels are left out of long fast runs
+#define SUMMARY_INTERNAL_BYTES (32 * 1024) // without psram
+#define PLOT_LINES 40 // rows drawn by default
+#define PLOT_WIDTH 50 // characters between the bars
+#define PLOT_CHUNK 256 // summary rows read at a time
+
+static const char *TAG = "summary";
+
+// Each level keeps the window it is filling, a full window becomes a row and is added to the next level up
+// so a frame is only looked at once, the coarser levels are built from rows. A level that did not fit in memory
+// still passes its windows up, it just keeps no rows
+static const uint32_t factors[LOG_SUMMARY_LEVELS] = {10, 100, 1000};
+
+typedef struct {
+	uint32_t capacity;
+	uint32_t rows;
+	int64_t *time;
+	uint16_t *minimum;
+	uint16_t *maximum;
+	uint16_t *mean;
+
+	// Window being filled
+	uint32_t frames;
+	int64_t firstUs;
+	uint16_t low[LOG_MAX_CHANNELS];
+	uint16_t high[LOG_MAX_CHANNELS];
+	uint32_t sum[LOG_MAX_CHANNELS]; // 1000 left justified samples still fit
+} summary_level_t;
+
+static summary_level_t levels[LOG_SUMMARY_LEVELS];
+static int summaryChannels = 0;
+
+static size_t rowBytes(int channels){
+	return sizeof(int64_t) + 3 * channels * sizeof(uint16_t);
+}
+
+// Rows a level may hold, one more than the whole windows for the partial window at each end
+// summaryBegin allocates this many and summaryBytesFor reserves this many, so the section never outgrows the log
+static uint32_t rowsFor(long frames, int level){
+	return (frames + factors[level] - 1) / factors[level] + 1;
+}
+
+size_t summaryBytesFor(int channels, long frames){
+	size_t bytes = sizeof(log_summary_prefix_t) + sizeof(uint32_t) + sizeof(log_summary_tail_t);
+	for(int level = 0; level < LOG_SUMMARY_LEVELS; level++){
+		bytes += rowsFor(frames, level) * rowBytes(channels);
+	}
+	return bytes;
+}
+
+void summaryEnd(){
+	for(int level = 0; level < LOG_SUMMARY_LEVELS; level++){
+		heap_caps_free(levels[level].time); // one allocation per level
+	}
+	memset(levels, 0, sizeof(levels));
+}
+
+// Coarsest first, they are the ones a plot of the whole run needs
+esp_err_t summaryBegin(int channels, long expectedFrames){
+	summaryEnd();
+	summaryChannels = channels;
+	bool psram = heap_caps_get_total_size(MALLOC_CAP_SPIRAM) != 0;
+	size_t budget = psram ? SUMMARY_MAX_BYTES : SUMMARY_INTERNAL_BYTES;
+
+	for(int level = LOG_SUMMARY_LEVELS - 1; level >= 0; level--){
+		summary_level_t *l = &levels[level];
+		uint32_t capacity = rowsFor(expectedFrames, level);
+		size_t bytes = capacity * rowBytes(channels);
+		if(bytes > budget){
+			ESP_LOGW(TAG, "%lux summary left out, %u KB does not fit", factors[level], (unsigned)(bytes / 1024));
+			continue;
+		}
+		uint8_t *rows = heap_caps_malloc(bytes, (psram ? MALLOC_CAP_SPIRAM : MALLOC_CAP_INTERNAL) | MALLOC_CAP_8BIT);
+		if(rows == NULL){
+			ESP_LOGW(TAG, "%lux summary left out, no memory", factors[level]);
+			continue;
+		}
+		budget -= bytes;
+		l->capacity = capacity;
+		l->time = (int64_t *)rows;
+		l->minimum = (uint16_t *)&rows[capacity * sizeof(int64_t)];
+		l->maximum = &l->minimum[capacity * channels];
+		l->mean = &l->maximum[capacity * channels];
+	}
+	return ESP_OK;
+}
+
+static void levelAdd(int level, uint32_t frames, int64_t firstUs, const uint16_t *low, const uint16_t *high, const uint32_t *sum);
+
+static void levelEmit(int level){
+	summary_level_t *l = &levels[level];
+	if(l->rows < l->capacity){
+		uint32_t row = l->rows++;
+		l->time[row] = l->firstUs;
+		for(int n = 0; n < summaryChannels; n++){
+			l->minimum[row * summaryChannels + n] = l->low[n];
+			l->maximum[row * summaryChannels + n] = l->high[n];
+			l->mean[row * summaryChannels + n] = l->sum[n] / l->frames;
+		}
+	}
+	if(level + 1 < LOG_SUMMARY_LEVELS){
+		levelAdd(level + 1, l->frames, l->firstUs, l->low, l->high, l->sum);
+	}
+	l->frames = 0;
+}
+
+static void levelAdd(int level, uint32_t frames, int64_t firstUs, const uint16_t *low, const uint16_t *high, const uint32_t *sum){
+	summary_level_t *l = &levels[level];
+	if(l->frames == 0){
+		l->firstUs = firstUs;
+		memcpy(l->low, low, summaryChannels * sizeof(uint16_t));
+		memcpy(l->high, high, summaryChannels * sizeof(uint16_t));
+		memset(l->sum, 0, sizeof(l->sum));
+	}
+	for(int n = 0; n < summaryChannels; n++){
+		if(low[n] < l->low[n]){
+			l->low[n] = low[n];
+		}
+		if(high[n] > l->high[n]){
+			l->high[n] = high[n];
+		}
+		l->sum[n] += sum[n];
+	}
+	l->frames += frames;
+	if(l->frames >= factors[level]){
+		levelEmit(level);
+	}
+}
+
+void summaryAddFrame(int64_t timeUs, const uint16_t *samples){
+	uint32_t sum[LOG_MAX_CHANNELS];
+	for(int n = 0; n < summaryChannels; n++){
+		sum[n] = samples[n];
+	}
+	levelAdd(0, 1, timeUs, samples, samples, sum);
+}
+
+void summaryWrite(void (*write)(const void *data, size_t bytes)){
+	for(int level = 0; level < LOG_SUMMARY_LEVELS; level++){ // finest first, each one feeds the next
+		if(levels[level].frames != 0){
+			levelEmit(level);
+		}
+	}
+
+	log_summary_prefix_t prefix = {
+		.magic = LOG_SUMMARY_MAGIC,
+		.channels = summaryChannels,
+		.levels = LOG_SUMMARY_LEVELS
+	};
+	for(int level = 0; level < LOG_SUMMARY_LEVELS; level++){
+		prefix.factor[level] = factors[level];
+		prefix.rows[level] = levels[level].rows;
+	}
+	write(&prefix, sizeof(prefix));
+	uint32_t crc = esp_rom_crc32_le(0, (uint8_t *)&prefix, sizeof(prefix));
+	uint32_t bytes = sizeof(prefix) + sizeof(crc);
+
+	for(int level = 0; level < LOG_SUMMARY_LEVELS; level++){
+		summary_level_t *l = &levels[level];
+		size_t timeBytes = l->rows * sizeof(int64_t);
+		size_t valueBytes = l->rows * summaryChannels * sizeof(uint16_t);
+		if(l->rows == 0){
+			continue;
+		}
+		write(l->time, timeBytes);
+		write(l->minimum, valueBytes);
+		write(l->maximum, valueBytes);
+		write(l->mean, valueBytes);
+		crc = esp_rom_crc32_le(crc, (uint8_t *)l->time, timeBytes);
+		crc = esp_rom_crc32_le(crc, (uint8_t *)l->minimum, valueBytes);
+		crc = esp_rom_crc32_le(crc, (uint8_t *)l->maximum, valueBytes);
+		crc = esp_rom_crc32_le(crc, (uint8_t *)l->mean, valueBytes);
+		bytes += timeBytes + 3 * valueBytes;
+	}
+	write(&crc, sizeof(crc));
+
+	log_summary_tail_t tail = {
+		.magic = LOG_TAIL_MAGIC,
+		.bytes = bytes
+	};
+	write(&tail, sizeof(tail));
+}
+
+// ================================= Plot ==============================================
+// Draws a time range of one channel from the summary, only the rows on screen are read from the card
+// The crc covers the whole section, host tools check it, the plot trusts the tail and the prefix
+
+static struct {
+	struct arg_int *index; // log<index>.bin
+	struct arg_int *channel; // in the order of the log columns
+	struct arg_int *from; // ms after the first sample
+	struct arg_int *to;
+	struct arg_int *lines;
+    struct arg_end *end;
+} plot_args;
+
+static bool readAt(FILE *in, long offset, void *data, size_t bytes){
+	return fseek(in, offset, SEEK_SET) == 0 && fread(data, 1, bytes, in) == bytes;
+}
+
+// First row at or after timeUs, rows when there is none, the times of a level only go up
+static bool rowSearch(FILE *in, long levelOffset, uint32_t rows, int64_t timeUs, uint32_t *row){
+	uint32_t low = 0;
+	uint32_t high = rows;
+	while(low < high){
+		uint32_t middle = low + (high - low) / 2;
+		int64_t middleUs;
+		if(readAt(in, levelOffset + middle * sizeof(int64_t), &middleUs, sizeof(middleUs)) == false){
+			return false;
+		}
+		if(middleUs < timeUs){
+			low = middle + 1;
+		}else{
+			high = middle;
+		}
+	}
+	*row = low;
+	return true;
+}
+
+typedef struct{
+	int64_t timeUs; // first row of the line
+	uint16_t low;
+	uint16_t high;
+	uint32_t sum; // of the row means
+	uint32_t rows;
+} plot_line_t;
+
+// Rows from first, count of them, merged into line sized bins
+// Read PLOT_CHUNK rows at a time, a coarse level over a long run can have far more rows than fit in memory
+static esp_err_t plotRows(FILE *in, long levelOffset, uint32_t rows, int channels, int channel, uint32_t first, uint32_t count, int lines){
+	uint32_t perLine = (count + lines - 1) / lines;
+	lines = (count + perLine - 1) / perLine;
+	plot_line_t *line = calloc(lines, sizeof(plot_line_t));
+	uint8_t *buffer = malloc(PLOT_CHUNK * (sizeof(int64_t) + 3 * channels * sizeof(uint16_t)));
+	if(line == NULL || buffer == NULL){
+		free(line);
+		free(buffer);
+		return ESP_ERR_NO_MEM;
+	}
+	int64_t *time = (int64_t *)buffer;
+	uint16_t *minimum = (uint16_t *)&buffer[PLOT_CHUNK * sizeof(int64_t)];
+	uint16_t *maximum = &minimum[PLOT_CHUNK * channels];
+	uint16_t *mean = &maximum[PLOT_CHUNK * channels];
+	long levelValueBytes = rows * channels * sizeof(uint16_t);
+
+	for(uint32_t chunk = 0; chunk < count; chunk += PLOT_CHUNK){
+		uint32_t n = (count - chunk < PLOT_CHUNK) ? count - chunk : PLOT_CHUNK;
+		uint32_t row = first + chunk;
+		size_t valueBytes = n * channels * sizeof(uint16_t);
+		long valuesOffset = levelOffset + rows * sizeof(int64_t) + row * channels * sizeof(uint16_t);
+		if(readAt(in, levelOffset + row * sizeof(int64_t), time, n * sizeof(int64_t)) == false
+			|| readAt(in, valuesOffset, minimum, valueBytes) == false
+			|| readAt(in, valuesOffset + levelValueBytes, maximum, valueBytes) == false
+			|| readAt(in, valuesOffset + 2 * levelValueBytes, mean, valueBytes) == false){
+			free(line);
+			free(buffer);
+			return ESP_ERR_INVALID_SIZE;
+		}
+		for(uint32_t i = 0; i < n; i++){
+			plot_line_t *l = &line[(chunk + i) / perLine];
+			uint16_t rowLow = minimum[i * channels + channel];
+			uint16_t rowHigh = maximum[i * channels + channel];
+			if(l->rows == 0){
+				l->timeUs = time[i];
+				l->low = rowLow;
+				l->high = rowHigh;
+			}
+			l->low = (rowLow < l->low) ? rowLow : l->low;
+			l->high = (rowHigh > l->high) ? rowHigh : l->high;
+			l->sum += mean[i * channels + channel];
+			l->rows++;
+		}
+	}
+	free(buffer);
+
+	uint16_t low = UINT16_MAX;
+	uint16_t high = 0;
+	for(int i = 0; i < lines; i++){ // the scale covers the whole range
+		low = (line[i].low < low) ? line[i].low : low;
+		high = (line[i].high > high) ? line[i].high : high;
+	}
+	uint32_t span = (high > low) ? high - low : 1;
+
+	for(int i = 0; i < lines; i++){
+		plot_line_t *l = &line[i];
+		uint16_t lineMean = l->sum / l->rows;
+
+		char bar[PLOT_WIDTH + 1];
+		memset(bar, ' ', PLOT_WIDTH);
+		bar[PLOT_WIDTH] = '\0';
+		int from = ((l->low - low) * (PLOT_WIDTH - 1)) / span;
+		int to = ((l->high - low) * (PLOT_WIDTH - 1)) / span;
+		for(int c = from; c <= to; c++){
+			bar[c] = '=';
+		}
+		bar[((lineMean - low) * (PLOT_WIDTH - 1)) / span] = '*';
+		printf("%9.3f s %5u %5u |%s|\n", (l->timeUs - line[0].timeUs) / 1000000.0, l->low, l->high, bar);
+	}
+	printf("%u to %u, * is the mean\n", low, high);
+	free(line);
+	return ESP_OK;
+}
+
+static int plotCommand(int argc, char **argv){
+	int nerrors = arg_parse(argc, argv, (void  **) &plot_args);
+	if (nerrors != 0) {
+        arg_print_errors(stderr, plot_args.end, argv[0]);
+        return 1;
+    }
+	if(loggingIsArmed()){
+		ESP_LOGE(TAG, "A run is armed, plot once it is written");
+		return 1;
+	}
+	int channel = (plot_args.channel->count != 0) ? plot_args.channel->ival[0] : 0;
+	int lines = (plot_args.lines->count != 0) ? plot_args.lines->ival[0] : PLOT_LINES;
+	if(lines < 1){
+		lines = 1;
+	}
+
+	char path[50];
+	sprintf(path, "%s/log%d.bin", SD_MOUNT_POINT, plot_args.index->ival[0]);
+	FILE *in = fopen(path, "r");
+	if(in == NULL){
+		ESP_LOGE(TAG, "No log %d", plot_args.index->ival[0]);
+		return 1;
+	}
+
+	log_file_header_t header;
+	log_summary_tail_t tail;
+	log_summary_prefix_t prefix;
+	if(readAt(in, 0, &header, sizeof(header)) == false || header.magic != LOG_FILE_MAGIC){
+		ESP_LOGE(TAG, "Not a log file");
+		fclose(in);
+		return 1;
+	}
+	if(header.version < LOG_SUMMARY_VERSION || header.version > LOG_FORMAT_VERSION){
+		ESP_LOGE(TAG, "Log %d has no summary this firmware can read", plot_args.index->ival[0]);
+		fclose(in);
+		return 1;
+	}
+	long fileBytes = (fseek(in, 0, SEEK_END) == 0) ? ftell(in) : 0;
+	long prefixOffset = fileBytes - (long)sizeof(tail);
+	if(fileBytes < (long)sizeof(tail) || readAt(in, prefixOffset, &tail, sizeof(tail)) == false || tail.magic != LOG_TAIL_MAGIC || tail.bytes > prefixOffset){
+		ESP_LOGE(TAG, "Log %d has no summary", plot_args.index->ival[0]);
+		fclose(in);
+		return 1;
+	}
+	prefixOffset -= tail.bytes;
+	if(readAt(in, prefixOffset, &prefix, sizeof(prefix)) == false || prefix.magic != LOG_SUMMARY_MAGIC || prefix.levels != LOG_SUMMARY_LEVELS || prefix.channels > LOG_MAX_CHANNELS){
+		ESP_LOGE(TAG, "Damaged summary");
+		fclose(in);
+		return 1;
+	}
+	if(channel < 0 || channel >= prefix.channels){
+		ESP_LOGE(TAG, "Log %d has %d channels", plot_args.index->ival[0], prefix.channels);
+		fclose(in);
+		return 1;
+	}
+
+	// Offsets of each level, times are taken from the coarsest level that has rows
+	long levelOffset[LOG_SUMMARY_LEVELS];
+	long offset = prefixOffset + sizeof(prefix);
+	int coarsest = -1;
+	for(int level = 0; level < LOG_SUMMARY_LEVELS; level++){
+		levelOffset[level] = offset;
+		offset += prefix.rows[level] * rowBytes(prefix.channels);
+		if(prefix.rows[level] != 0){
+			coarsest = level;
+		}
+	}
+	if(coarsest < 0){
+		ESP_LOGE(TAG, "Empty summary");
+		fclose(in);
+		return 1;
+	}
+	int64_t firstUs;
+	if(readAt(in, levelOffset[coarsest], &firstUs, sizeof(firstUs)) == false){
+		ESP_LOGE(TAG, "Damaged summary");
+		fclose(in);
+		return 1;
+	}
+	int64_t startUs = firstUs + ((plot_args.from->count != 0) ? plot_args.from->ival[0] * 1000LL : 0);
+	int64_t endUs = (plot_args.to->count != 0) ? firstUs + plot_args.to->ival[0] * 1000LL : INT64_MAX;
+
+	// The coarsest level with a row for every line, the finest there is otherwise
+	int chosen = -1;
+	uint32_t first = 0;
+	uint32_t count = 0;
+	for(int level = coarsest; level >= 0; level--){
+		uint32_t rows = prefix.rows[level];
+		if(rows == 0){
+			continue;
+		}
+		uint32_t r = 0;
+		uint32_t last = 0;
+		if(rowSearch(in, levelOffset[level], rows, startUs, &r) == false || rowSearch(in, levelOffset[level], rows, endUs, &last) == false){
+			ESP_LOGE(TAG, "Damaged summary");
+			fclose(in);
+			return 1;
+		}
+		last = (last < r) ? r : last; // an end before the start still shows the row it lands in
+		chosen = level;
+		first = (r == 0) ? 0 : r - 1; // the row the range starts in
+		count = last - first;
+		if(count >= (uint32_t)lines){
+			break;
+		}
+	}
+	if(count == 0){
+		ESP_LOGE(TAG, "Nothing in that range");
+		fclose(in);
+		return 1;
+	}
+
+	int adcChannel = 0; // the columns are the enabled adc channels in order
+	for(int i = 0, n = 0; i < LOG_MAX_CHANNELS; i++){
+		if((header.channelMask & (1 << i)) && n++ == channel){
+			adcChannel = i;
+			break;
+		}
+	}
+	printf("%s, %lux rows %lu to %lu\n", loggingChannelName(adcChannel), prefix.factor[chosen], first, first + count - 1);
+	esp_err_t err = plotRows(in, levelOffset[chosen], prefix.rows[chosen], prefix.channels, channel, first, count, lines);
+	fclose(in);
+	return (err == ESP_OK) ? 0 : 1;
+}
+
+void summaryRegisterCommands(){
+	plot_args.index = arg_int1(NULL, NULL, "<index>", "Log number, log<index>.bin on the card");
+	plot_args.channel = arg_int0("c", NULL, "<column>", "Channel in the order of the log columns, 0 by default");
+	plot_args.from = arg_int0("s", NULL, "<ms>", "Start of the range after the first sample");
+	plot_args.to = arg_int0("e", NULL, "<ms>", "End of the range after the first sample");
+	plot_args.lines = arg_int0("l", NULL, "<lines>", "Lines to draw");
+	plot_args.end = arg_end(5);
+
+	const esp_console_cmd_t cmd_plot = {
+		.command = "log-plot",
+		.help = "Plot min, max and mean of a log from its summary.",
+		.hint = NULL,
+		.func = &plotCommand,
+		.argtable = &plot_args
+	};
+
+	ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_plot));
+}
@@ -0,0 +1,33 @@
+/********************************************************************************
+ * File Name          : summary.h
+ * Author             : Jack Shaver
+ * Date               : 10/17/2026
+ * Description        : Log Summary Header
+ ********************************************************************************/
+
+#ifndef summary_h
+#define summary_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// Min, max and mean of every 10, 100 and 1000 frames, one level each, built a frame at a time by the log writer
+extern esp_err_t summaryBegin(int channels, long expectedFrames); // levels that do not fit in memory are left out
+extern void summaryAddFrame(int64_t timeUs, const uint16_t *samples); // samples left justified, channels of them
+extern void summaryWrite(void (*write)(const void *data, size_t bytes)); // the section and its tail, closes the partial windows
+extern void summaryEnd();
+
+extern size_t summaryBytesFor(int channels, long frames); // most summaryWrite can write
+
+extern void summaryRegisterCommands();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
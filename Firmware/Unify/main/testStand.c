@@ -30,7 +30,11 @@
 #include "leds.h"
 #include "adc.h" // the adc in the s3
 #include "sd.h"
+#include "flashLog.h"
 #include "logging.h"
+#include "export.h"
+#include "codec.h"
+#include "summary.h"
 #include "espnow.h"
 
 // Console
@@ -86,6 +90,7 @@ void testStandInit(){
 	xTaskCreate(fireTask, "fireTask", 4096, NULL, 2, NULL);
 	
 	sdInit();
+	flashLogInit();
 	spiInit(SPI_MISO_PIN, SPI_MOSI_PIN, SPI_CLK_PIN, SPI_CS_PIN);
 	loggingInit();
 
@@ -296,7 +301,7 @@ void systemFire(){
 		return;
 	}
 	
-	if(i2cGetGpioSignal(I2C_SD_CARD_DETECT) == 0){
+	if(loggingNeedsCard() && i2cGetGpioSignal(I2C_SD_CARD_DETECT) == 0){ // flash runs do not need the card
 		espnowSendCommand(espnowNoSdCardCommand);
 		return;
 	}
@@ -322,6 +327,12 @@ void systemAbort(){
 void fireTask(void *arg){
 	 while(1){
         if(xSemaphoreTake(fireTaskBlockSemaphore, 0xffff) == pdTRUE){ 
+			// Sample through the countdown so the log has a baseline before ignition, never fire without a log
+			if(loggingArm() != ESP_OK){
+				espnowSendCommand(espnowAbortConfirmationCommand);
+				ledsReportError(0);
+				continue;
+			}
 			buzzerSetEnable(true);
 			//ledsSetState(ledStatus, ledFlashing); 
 		
@@ -348,11 +359,11 @@ void fireTask(void *arg){
 			
 			if(i2cGetGpioSignal(I2C_KEY) == 1){
 				espnowSendCommand(espnowBadKeyStateCommand);
+				loggingStop(); // discards the armed run
 				break;
 			}
 			
-			loggingStart();
-			vTaskDelay(100/ portTICK_PERIOD_MS);
+			loggingTrigger(); // the ring already holds the pre trigger window
 			i2cSetGpioSignal(I2C_IGNITER_ENABLE, true);
 			
 			vTaskDelay(1000/ portTICK_PERIOD_MS);
@@ -382,8 +393,12 @@ void consoleInit(){
 	//espnowRegisterCommands(); // wireless comms
 	//adcRegisterCommands(); // internal adc, temperature and battery
 	spiRegisterCommands(); // external adc, rear panel sensors
-	//sdRegisterCommands(); // sd card
-	//loggingRegisterCommands(); // monitoring and logging
+	sdRegisterCommands(); // sd card
+	loggingRegisterCommands(); // monitoring and logging
+	exportRegisterCommands(); // binary logs to csv
+	flashLogRegisterCommands(); // runs logged to internal flash
+	codecRegisterCommands(); // block codec benchmark
+	summaryRegisterCommands(); // plots from the log summaries
 
 	esp_console_repl_t *repl = NULL;
     esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();